@@ -1,3 +1,3 @@
 #! /bin/bash
 
-g++ -std=gnu++11 -g -lreadline -o pbrain pbrain.cpp
+g++ -std=gnu++11 -g -O2 -o pbrain pbrain.cpp -lreadline -pthread
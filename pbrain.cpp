@@ -7,27 +7,45 @@
 #include <string>
 #include <vector>
 #include <map>
+#include <algorithm>
+#include <unordered_map>
 #include <sstream>
+#include <random>
+#include <thread>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
 #include <stack>
 #include <stdexcept>
 #include <cstdio>
+#include <cstring>
 #include <cmath>
+#include <cerrno>
 #include <unistd.h>
+#include <getopt.h>
 #include <termios.h>
 #include <signal.h>
 #include <sys/ioctl.h>
+#include <sys/signalfd.h>
+#include <poll.h>
+#include <time.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#include <fcntl.h>
 #include <readline/readline.h> // TODO Remove
 #include <readline/history.h>
 
-// TODO
-// ^C should interrrupt the running program and place the user at a fresh prompt rather than exiting
-
 typedef uint8_t cell;
 typedef long index_t;
 
 bool gui = 0;
 unsigned int gui_sleep = 40 * 1000;
 int ionum = 0;
+volatile sig_atomic_t interrupted = 0; // Set by ^C and polled at loop back-edges and procedure calls
 
 namespace util
 {
@@ -54,6 +72,108 @@ namespace util
 		while (std::getline(ss, cur, delim)) if (cur != "") ret.push_back(cur);
 		return ret;
 	}
+
+	uint64_t hash(const std::string &s, const std::string &salt = "")
+	{
+		uint64_t h = 14695981039346656037ull; // FNV-1a
+		for (const std::string *part : {&salt, &s})
+		{
+			for (char c : *part)
+			{
+				h ^= (unsigned char) c;
+				h *= 1099511628211ull;
+			}
+			h *= 1099511628211ull;
+		}
+		return h;
+	}
+
+	std::string hash_hex(uint64_t h)
+	{
+		std::stringstream ss{};
+		ss << std::hex << std::setw(16) << std::setfill('0') << h;
+		return ss.str();
+	}
+
+	std::string cachedir()
+	{
+		const char *xdg = getenv("XDG_CACHE_HOME"), *home = getenv("HOME");
+		std::string base = xdg && *xdg ? xdg : (home && *home ? std::string{home} + "/.cache" : "/tmp"); // Empty means unset, as in the XDG spec
+		mkdir(base.c_str(), 0755);
+		std::string dir = base + "/pbrain";
+		if (mkdir(dir.c_str(), 0755) != 0 && errno != EEXIST) throw std::runtime_error{"Couldn't create cache directory " + dir};
+		return dir;
+	}
+
+	void copyfile(const std::string &src, const std::string &dest)
+	{
+		std::ifstream in{src, std::ios::binary};
+		std::ofstream out{dest, std::ios::binary};
+		if (in.fail() || out.fail()) throw std::runtime_error{"Couldn't copy " + src + " to " + dest};
+		out << in.rdbuf();
+	}
+}
+
+namespace events
+{
+	const int resize_interval = 50; // Minimum milliseconds between redraws caused by resizing
+
+	int sigfd = -1;
+	bool resize_pending = false;
+	long last_resize = 0;
+	void (*on_resize)() = 0;
+
+	long now() // Monotonic milliseconds
+	{
+		struct timespec ts;
+		clock_gettime(CLOCK_MONOTONIC, &ts);
+		return ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+	}
+
+	void init(void (*resize_cb)())
+	{
+		sigset_t mask;
+		sigemptyset(&mask);
+		sigaddset(&mask, SIGWINCH);
+		sigprocmask(SIG_BLOCK, &mask, 0);
+		sigfd = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC);
+		on_resize = resize_cb;
+	}
+
+	void flush_resize()
+	{
+		if (! resize_pending || now() - last_resize < resize_interval) return;
+		resize_pending = false;
+		last_resize = now();
+		if (on_resize) on_resize();
+	}
+
+	bool wait(int timeout, bool input = false) // Service events for up to timeout ms (forever if negative); returns true if stdin is readable
+	{
+		long deadline = now() + timeout;
+		while (true)
+		{
+			struct pollfd fds[2] = {{sigfd, POLLIN, 0}, {STDIN_FILENO, POLLIN, 0}};
+			long left = timeout < 0 ? -1 : deadline - now();
+			if (left < 0 && timeout >= 0) left = 0;
+			if (resize_pending)
+			{
+				long until = last_resize + resize_interval - now();
+				if (until < 0) until = 0;
+				if (left < 0 || until < left) left = until;
+			}
+			int n = poll(fds, input ? 2 : 1, left);
+			if (n < 0 && errno != EINTR) return false;
+			if (n > 0 && (fds[0].revents & POLLIN))
+			{
+				struct signalfd_siginfo info;
+				while (read(sigfd, &info, sizeof(info)) == sizeof(info)) resize_pending = true; // Storms coalesce into one redraw
+			}
+			flush_resize();
+			if (input && n > 0 && (fds[1].revents & (POLLIN | POLLHUP))) return true;
+			if (timeout >= 0 && now() >= deadline) return false;
+		}
+	}
 }
 
 namespace curses
@@ -90,11 +210,18 @@ namespace curses
 
 	char readchar()
 	{
-		if (gui) out << "\033[?25h" << std::flush;
-		else set_raw();
+		if (gui)
+		{
+			out << "\033[?25h" << std::flush;
+			unsigned char c;
+			while (! events::wait(-1, true)); // Keep redrawing on resize while waiting for a key
+			char ret = read(STDIN_FILENO, &c, 1) == 1 ? c : EOF;
+			out << "\033[?25l" << std::flush;
+			return ret;
+		}
+		set_raw();
 		char ret = getc(stdin);
-		if (gui) out << "\033[?25l" << std::flush;
-		else set_cooked();
+		set_cooked();
 		return ret;
 	}
 
@@ -257,13 +384,74 @@ namespace curses
 		return ldiff;
 	}
 
+	struct gapbuf
+	{
+		std::vector<char> data;
+		std::size_t gap, gapend; // The unused region is [gap, gapend)
+
+		gapbuf() : data{}, gap{0}, gapend{0} { }
+
+		std::size_t size() const { return data.size() - (gapend - gap); }
+
+		char operator [](std::size_t i) const { return i < gap ? data[i] : data[i + gapend - gap]; }
+
+		void movegap(std::size_t pos)
+		{
+			if (pos < gap) std::copy_backward(data.begin() + pos, data.begin() + gap, data.begin() + gapend);
+			else if (pos > gap) std::copy(data.begin() + gapend, data.begin() + gapend + (pos - gap), data.begin() + gap);
+			gapend += pos - gap;
+			gap = pos;
+		}
+
+		void insert(std::size_t pos, char c)
+		{
+			if (gap == gapend)
+			{
+				std::size_t tail = data.size() - gapend, grow = data.size() + 64;
+				data.resize(data.size() + grow);
+				std::copy_backward(data.begin() + gapend, data.begin() + gapend + tail, data.end());
+				gapend += grow;
+			}
+			movegap(pos);
+			data[gap++] = c;
+		}
+
+		void erase(std::size_t pos)
+		{
+			movegap(pos + 1);
+			gap--;
+		}
+
+		void erase_front(std::size_t n)
+		{
+			movegap(size());
+			data.erase(data.begin(), data.begin() + n);
+			gap -= n;
+			gapend -= n;
+		}
+
+		void assign(const std::string &s)
+		{
+			data.assign(s.begin(), s.end());
+			gap = gapend = data.size();
+		}
+
+		std::string str() const
+		{
+			std::string ret{data.begin(), data.begin() + gap};
+			ret.append(data.begin() + gapend, data.end());
+			return ret;
+		}
+	};
+
 	struct iobox
 	{
 		int x, y, w, h, pos, off;
-		std::string buf;
+		gapbuf buf;
+		std::size_t limit; // Maximum scrollback in characters, or 0 for unbounded
 		bool input;
 
-		iobox() : x{0}, y{0}, w{0}, h{0}, pos{0}, off{0}, buf{}, input{1} { }
+		iobox() : x{0}, y{0}, w{0}, h{0}, pos{0}, off{0}, buf{}, limit{0}, input{1} { }
 
 		void setsize(int newy, int newx, int newh, int neww)
 		{
@@ -290,9 +478,9 @@ namespace curses
 			else move(y + i / w, x + i % w);
 		}
 
-		void reset(std::string content = "")
+		void reset(const std::string &content = "")
 		{
-			buf = content;
+			buf.assign(content);
 			redraw();
 			pos = content.size();
 		}
@@ -350,10 +538,20 @@ namespace curses
 		void addchar(char c)
 		{
 			if (c < 32 || c > 126) return;
-			buf.insert(pos++, 1, c);
+			buf.insert(pos++, c);
+			if (limit && buf.size() > limit && w > 0) trim();
 			adjoff();
 		}
 
+		void trim() // Drop whole rows from the front of the scrollback without moving the visible text
+		{
+			std::size_t drop = std::min<std::size_t>(off, buf.size() - limit / 2) / w * w;
+			if (drop == 0) return;
+			buf.erase_front(drop);
+			pos -= drop;
+			off -= drop;
+		}
+
 		char in()
 		{
 			putcursor();
@@ -397,7 +595,7 @@ namespace curses
 		void backspace()
 		{
 			if (pos == 0) return;
-			buf.erase(pos - 1, 1);
+			buf.erase(pos - 1);
 			pos--;
 			adjoff();
 		}
@@ -467,8 +665,8 @@ namespace curses
 				char c = io.in();
 				if (c == '\n')
 				{
-					dest = io.buf;
-					histset(io.buf, true);
+					dest = io.buf.str();
+					histset(dest, true);
 					histnew();
 					return true;
 				}
@@ -482,7 +680,7 @@ namespace curses
 					else if (d == 'D') io.back();
 					else if (d == 'A' || d == 'B')
 					{
-						histset(io.buf);
+						if (histidx == history.size() - 1) histset(io.buf.str()); // Only the line being edited is saved
 						histmove(d == 'A' ? -1 : 1);
 					}
 				}
@@ -500,55 +698,209 @@ namespace curses
 
 struct tape
 {
-	index_t p, offset;
-	bool numchange;
-	std::vector<cell> pos, neg;
+	index_t p, offset, origin; // Cell idx lives at mem[origin + idx]
+	cell *mem; // Anonymous mapping, so untouched and released pages cost nothing
+	std::size_t len, cap; // Addressable cells and mapped bytes
+	std::size_t limit; // Resident cap in bytes, 0 for none
+	std::size_t rss; // Resident bytes as of the last growth, release, reset or UI frame, so drawing the statistics doesn't scan the mapping
+	bool huge;
+	bool follow, zoom; // Whether the view tracks the pointer, and whether it shows a hex dump instead of a strip
+	index_t focus; // Cell the view is fixed on when not following
+
+	static const std::size_t hugesize = 1 << 21;
+
+	static std::size_t pagesize()
+	{
+		static std::size_t ps = sysconf(_SC_PAGESIZE);
+		return ps;
+	}
+
+	static cell *map(std::size_t bytes)
+	{
+		void *ret = mmap(0, bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if (ret == MAP_FAILED) throw std::runtime_error{"Couldn't allocate tape: " + std::string{strerror(errno)}};
+		return (cell *) ret;
+	}
+
+	tape() : p{0}, offset{-1}, origin{0}, mem{map(pagesize())}, len{1}, cap{pagesize()}, limit{0}, rss{0}, huge{false}, follow{true}, zoom{false}, focus{0} { }
+
+	tape(const tape &) = delete;
 
-	tape() : p{0}, offset{-1}, numchange{true}, pos{0}, neg{0} { }
+	tape &operator =(const tape &) = delete;
+
+	~tape() { munmap(mem, cap); }
+
+	void reserve(index_t lo, index_t hi) // Make cells lo through hi addressable without further checks
+	{
+		index_t curlo = -origin, curhi = len - origin - 1;
+		if (lo >= curlo && hi <= curhi) return;
+		index_t grow = len;
+		if (limit) grow = std::min<index_t>(grow, std::max<index_t>(0, limit - len)); // Don't map past the cap unless asked to
+		index_t newlo = lo < curlo ? std::min(lo, curlo - grow) : curlo;
+		index_t newhi = hi > curhi ? std::max(hi, curhi + grow) : curhi;
+		std::size_t newlen = newhi - newlo + 1, shift = curlo - newlo;
+		std::size_t bytes = (newlen + pagesize() - 1) / pagesize() * pagesize();
+		if (limit && bytes > cap && resident() + (bytes - cap) > limit)
+		{
+			release();
+			if (resident() + (hi - lo + 1) > limit) throw std::runtime_error{"Tape exceeds memory limit of " + util::t2s(limit) + " bytes"};
+		}
+		if (bytes > cap)
+		{
+			void *ret = mremap(mem, cap, bytes, MREMAP_MAYMOVE);
+			if (ret == MAP_FAILED) throw std::runtime_error{"Couldn't grow tape: " + std::string{strerror(errno)}};
+			mem = (cell *) ret;
+			cap = bytes;
+			if (huge && cap >= hugesize) madvise(mem, cap, MADV_HUGEPAGE);
+		}
+		if (shift) slide(shift);
+		len = newlen;
+		origin = -newlo;
+		rss = resident();
+	}
 
 	cell *resolve(index_t idx)
 	{
-		std::vector<cell> *arr = &pos;
-		if (idx < 0) { arr = &neg; idx *= -1; }
-		if (arr->size() <= idx) arr->resize(idx + 1);
-		return &(*arr)[idx];
+		if ((std::size_t) (origin + idx) >= len) reserve(idx, idx);
+		return &mem[origin + idx];
 	}
 
-	void draw(int y, int x, int w, bool redraw = true)
+	void slide(std::size_t shift) // Move mem[0, len) up by shift bytes, touching only resident pages that hold data so released pages stay released
 	{
-		static int ldiff = -1;
-		static index_t old_p = -1, old_offset = 0;
+		std::size_t ps = pagesize(), n = (len + ps - 1) / ps;
+		std::vector<unsigned char> pages(n);
+		if (mincore(mem, n * ps, pages.data()) != 0) pages.assign(n, 1);
+		for (std::size_t i = n; i-- > 0; ) // From the top, so no page is overwritten before it has moved
+		{
+			std::size_t lo = i * ps, hi = std::min(len, lo + ps);
+			if (! (pages[i] & 1) || std::find_if(mem + lo, mem + hi, [](cell c) { return c != 0; }) == mem + hi) continue;
+			memmove(mem + lo + shift, mem + lo, hi - lo);
+			if (shift >= ps) madvise(mem + lo, ps, MADV_DONTNEED);
+			else memset(mem + lo, 0, shift);
+		}
+	}
+
+	std::size_t resident() const // Bytes of the tape actually backed by memory
+	{
+		std::vector<unsigned char> pages(cap / pagesize());
+		if (mincore(mem, cap, pages.data()) != 0) return cap;
+		std::size_t ret = 0;
+		for (unsigned char page : pages) if (page & 1) ret += pagesize();
+		return ret;
+	}
+
+	std::size_t release() // Hand resident pages that are entirely zero back to the OS; returns bytes released
+	{
+		std::size_t ps = pagesize(), n = cap / ps, ret = 0, run = 0;
+		std::vector<unsigned char> pages(n);
+		if (mincore(mem, cap, pages.data()) != 0) return 0;
+		for (std::size_t i = 0; i <= n; i++)
+		{
+			bool zero = i < n && (pages[i] & 1);
+			if (zero)
+			{
+				const uint64_t *words = (const uint64_t *) (mem + i * ps);
+				for (std::size_t j = 0; j < ps / sizeof(uint64_t) && zero; j++) zero = ! words[j];
+			}
+			if (zero) run++;
+			else if (run)
+			{
+				madvise(mem + (i - run) * ps, run * ps, MADV_DONTNEED);
+				ret += run * ps;
+				run = 0;
+			}
+		}
+		rss = resident();
+		return ret;
+	}
+
+	cell peek(index_t idx) const // Read a cell without making it addressable
+	{
+		return (std::size_t) (origin + idx) < len ? mem[origin + idx] : 0;
+	}
+
+	void draw(int y, int x, int w, bool redraw = true) // Cost depends only on the window size, and only cells whose value changed are redrawn
+	{
+		static int ldiff = -1, old_slot = 0;
+		static bool old_zoom = false, old_follow = true;
+		static index_t old_focus = 0, shown_base = 0;
+		static std::vector<int> shown{}; // What each slot of the window showed last time
 		std::ostream &out = std::cout;
-		int n = (w - 1) / 6;
-		if (offset < 0) offset = n / 2;
-		else if (offset < 2) offset = 2;
-		else if (offset >= n - 2) offset = n - 3;
-		bool rdr_tape = false, rdr_num = false;
-		if (numchange) rdr_num = true;
-		numchange = false;
-		if (redraw) rdr_tape = rdr_num = true;
-		//else if (p - old_p == offset - old_offset) rdr_tape = true;
-		else if (offset == old_offset) rdr_num = true;
-		else rdr_num = true;
-		if (rdr_tape) ldiff = curses::tape(y, x, w, offset, 5);
-		else ldiff = curses::tape(y, x, w, offset, 5, old_offset);
-		if (rdr_num) for (int i = 0; i < n; i++)
-		{
-			cell val = *resolve(p - offset + i);
+		if (zoom != old_zoom || follow != old_follow || (! follow && focus != old_focus))
+		{
+			for (int row = y - 1; row <= y + 2; row++)
+			{
+				curses::move(row, x);
+				out << std::string(w, ' ');
+			}
+			redraw = true;
+		}
+		old_zoom = zoom;
+		old_follow = follow;
+		old_focus = focus;
+		index_t target = follow ? p : focus;
+		if (zoom)
+		{
+			index_t base = (target & ~(index_t) 15) - 16;
+			if (redraw || shown.size() != 64 || shown_base != base) for (int row = 0; row < 4; row++)
+			{
+				curses::move(y - 1 + row, x);
+				out << std::setw(12) << base + 16 * row << ":";
+			}
+			if (redraw || shown.size() != 64) shown.assign(64, -1);
+			shown_base = base;
+			for (int i = 0; i < 64; i++)
+			{
+				int val = peek(base + i) | (base + i == p ? 0x100 : 0);
+				if (shown[i] == val) continue;
+				shown[i] = val;
+				curses::move(y - 1 + i / 16, x + 14 + (i % 16) * 3);
+				if (val & 0x100) curses::attr_on(7);
+				out << "0123456789abcdef"[(val >> 4) & 15] << "0123456789abcdef"[val & 15];
+				if (val & 0x100) curses::attr_reset();
+			}
+			return;
+		}
+		int n = (w - 1) / 6, slot = n / 2;
+		if (follow)
+		{
+			if (offset < 0) offset = n / 2;
+			else if (offset < 2) offset = 2;
+			else if (offset >= n - 2) offset = n - 3;
+			slot = offset;
+		}
+		else if (redraw)
+		{
+			curses::move(y - 1, x);
+			out << "Cell " << focus;
+		}
+		if (redraw) ldiff = curses::tape(y, x, w, slot, 5);
+		else ldiff = curses::tape(y, x, w, slot, 5, old_slot);
+		if (redraw || shown.size() != (std::size_t) n) shown.assign(n, -1);
+		for (int i = 0; i < n; i++)
+		{
+			cell val = peek(target - slot + i);
+			if (shown[i] == val) continue;
+			shown[i] = val;
 			curses::move(y + 1, x + 2 + ldiff + i * 6);
 			if (val < 100) out << ' ';
 			out << (int) val << ' ';
 		}
-		old_p = p;
-		old_offset = offset;
+		old_slot = slot;
 	}
 
-	void reset()
+	void jump(index_t idx) // Show the tape around idx instead of around the pointer
+	{
+		follow = false;
+		focus = idx;
+	}
+
+	void reset() // Also gives the whole tape back to the OS
 	{
-		neg.clear();
-		neg.resize(1);
-		pos.clear();
-		pos.resize(1);
+		madvise(mem, cap, MADV_DONTNEED);
+		rss = 0;
+		len = 1;
+		origin = 0;
 		p = 0;
 	}
 
@@ -566,9 +918,139 @@ struct tape
 
 	void r() { p++; offset++; } // >
 
-	void dec() { (*resolve(p))--; numchange = true; } // -
+	void dec() { (*resolve(p))--; } // -
+
+	void inc() { (*resolve(p))++; } // +
+};
+
+struct trace // Binary execution trace, recorded into a memory-mapped ring file
+{
+	enum kind : uint8_t { loop_enter, loop_iter, loop_exit, call, ret, io_in, io_out, sample };
+
+	struct header
+	{
+		char magic[4];
+		uint32_t version;
+		uint64_t capacity, head; // head counts every record ever written
+	};
+
+	struct record
+	{
+		uint64_t a, b; // Kind in the top byte of a, payload in the rest
+
+		kind type() const { return (kind) (a >> 56); }
+		uint64_t val() const { return a & ((1ull << 56) - 1); }
+	};
+
+	static const uint32_t version = 1;
+	static const unsigned long sample_interval = 1 << 16;
+
+	header *h;
+	record *ring;
+	std::size_t size;
+	unsigned long next_sample;
+
+	trace(const std::string &path, uint64_t capacity = 1 << 20) : h{0}, ring{0}, size{sizeof(header) + capacity * sizeof(record)}, next_sample{0}
+	{
+		int fd = open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+		if (fd < 0 || ftruncate(fd, size) != 0) throw std::runtime_error{"Couldn't create trace file " + path};
+		void *map = mmap(0, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+		close(fd);
+		if (map == MAP_FAILED) throw std::runtime_error{"Couldn't map trace file " + path};
+		h = (header *) map;
+		memcpy(h->magic, "PBT", 4);
+		h->version = version;
+		h->capacity = capacity;
+		h->head = 0;
+		ring = (record *) (h + 1);
+	}
+
+	~trace()
+	{
+		msync(h, size, MS_ASYNC);
+		munmap(h, size);
+	}
+
+	void put(kind k, uint64_t val, uint64_t b = 0)
+	{
+		record &r = ring[h->head++ % h->capacity];
+		r.a = ((uint64_t) k << 56) | (val & ((1ull << 56) - 1));
+		r.b = b;
+	}
+
+	void loop(kind k, std::size_t pos, unsigned long cnt, index_t ptr)
+	{
+		put(k, pos);
+		if (cnt >= next_sample)
+		{
+			put(sample, cnt, ptr);
+			next_sample = cnt + sample_interval;
+		}
+	}
 
-	void inc() { (*resolve(p))++; numchange = true; } // +
+	static void analyze(const std::string &path, std::ostream &out)
+	{
+		std::ifstream file{path, std::ios::binary | std::ios::ate};
+		uint64_t size = file ? (uint64_t) file.tellg() : 0;
+		file.seekg(0);
+		header hd;
+		if (! file.read((char *) &hd, sizeof(hd)) || std::string{hd.magic, 4} != std::string{"PBT", 4} || hd.version != version) throw std::runtime_error{"Not a pbrain trace: " + path};
+		if (hd.capacity == 0 || hd.capacity > (size - sizeof(hd)) / sizeof(record)) throw std::runtime_error{"Trace ring doesn't fit in " + path};
+		std::vector<record> recs(hd.capacity);
+		if (! file.read((char *) recs.data(), hd.capacity * sizeof(record))) throw std::runtime_error{"Couldn't read trace " + path};
+		uint64_t first = hd.head > hd.capacity ? hd.head - hd.capacity : 0;
+		std::map<std::vector<int>, unsigned long> calls{};
+		std::vector<int> path_ids{};
+		std::map<uint64_t, std::map<int, unsigned long>> trips{}; // Loop position -> log2 bucket -> count
+		std::vector<std::pair<uint64_t, unsigned long>> loops{};
+		std::vector<std::string> timeline{};
+		unsigned long cnt = 0;
+		char lastdir = 0;
+		for (uint64_t n = first; n < hd.head; n++)
+		{
+			const record &r = recs[n % hd.capacity];
+			switch (r.type())
+			{
+				case loop_enter: loops.push_back(std::make_pair(r.val(), 1ul)); break;
+				case loop_iter: if (! loops.empty() && loops.back().first == r.val()) loops.back().second++; break;
+				case loop_exit:
+					if (loops.empty() || loops.back().first != r.val()) break; // Entered before the start of the ring
+					trips[r.val()][(int) std::log2((double) loops.back().second)]++;
+					loops.pop_back();
+					break;
+				case call:
+					path_ids.push_back((int) r.b);
+					calls[path_ids]++;
+					break;
+				case ret: if (! path_ids.empty()) path_ids.pop_back(); break;
+				case io_in: case io_out:
+				{
+					char dir = r.type() == io_in ? '<' : '>';
+					if (dir != lastdir) timeline.push_back("~" + util::t2s(cnt) + " " + dir + " ");
+					lastdir = dir;
+					char c = (char) r.val();
+					std::ostringstream esc{};
+					if (c >= 32 && c <= 126 && c != '\\') esc << c;
+					else esc << "\\x" << std::hex << std::setw(2) << std::setfill('0') << (int) (unsigned char) c;
+					timeline.back() += esc.str();
+					break;
+				}
+				case sample: cnt = r.val(); lastdir = 0; break;
+			}
+		}
+		out << "Records: " << hd.head - first << " of " << hd.head << " written\n\nCall tree:\n";
+		for (const std::pair<const std::vector<int>, unsigned long> &c : calls)
+			out << std::string(2 * c.first.size(), ' ') << c.first.back() << "  x" << c.second << "\n";
+		out << "\nLoop trip counts (position: trips >= 2^n -> loops):\n";
+		for (const std::pair<const uint64_t, std::map<int, unsigned long>> &l : trips)
+		{
+			out << "  " << l.first << ":";
+			for (const std::pair<const int, unsigned long> &b : l.second) out << "  " << (1ul << b.first) << "+ x" << b.second;
+			out << "\n";
+		}
+		out << "\nI/O timeline (instruction count at last sample):\n";
+		for (const std::string &t : timeline) out << "  " << t << "\n";
+	}
 };
 
 struct ptable
@@ -580,6 +1062,7 @@ struct ptable
 
 		pinfo(std::size_t st, const std::string &content) : start{st}, length{content.size()}, preview{content.substr(0, 100)} { }
 		pinfo(pinfo &&orig) = default;
+		pinfo(const pinfo &orig) = default;
 		pinfo() = default;
 		pinfo &operator =(const pinfo &other) = default;
 	};
@@ -591,6 +1074,7 @@ struct ptable
 		
 		stackp(cell i, std::size_t r) : id{i}, ret{r} { }
 		stackp(stackp &&orig) = default;
+		stackp(const stackp &orig) = default;
 		stackp() = default;
 		stackp &operator =(const stackp &other) = default;
 	};
@@ -599,6 +1083,7 @@ struct ptable
 	std::map<cell, pinfo> table;
 	bool dirty = true;
 	int cur = -1;
+	trace *tr = 0;
 	
 	void draw(int y, int x, int h, int w, bool redraw = true)
 	{
@@ -648,6 +1133,7 @@ struct ptable
 		if (! table.count(id)) return p; // Don't jump if absent entry
 		callstack.push(stackp{id, p});
 		cur = id;
+		if (tr) tr->put(trace::call, table[id].start, id);
 		return table[id].start;
 	}
 
@@ -656,6 +1142,7 @@ struct ptable
 		if (callstack.empty()) throw std::runtime_error{"Tried to pop empty callstack"};
 		std::size_t addr = callstack.top().ret;
 		callstack.pop();
+		if (tr) tr->put(trace::ret, addr);
 		if (callstack.empty()) cur = -1;
 		else cur = callstack.top().id;
 		return addr;
@@ -669,140 +1156,1866 @@ struct ptable
 	}
 };
 
-struct machine
+struct program
 {
-	std::string deck;
-	tape t;
-	ptable pt;
-	std::size_t p, offset;
-	unsigned long cnt;
-	std::istream &in;
-	std::ostream &out;
-	curses::iobox inbox, outbox;
+	enum opcode : uint8_t { op_add, op_move, op_clear, op_in, op_out, op_jz, op_jnz, op_def, op_ret, op_call, op_stop, op_posn, op_num, op_nl, op_super };
 
-	machine(std::istream &i) : deck{}, t{}, pt{}, p{0}, offset{0}, cnt{0}, in{i}, out{std::cout}, inbox{}, outbox{} { }
+	struct op
+	{
+		opcode code;
+		long arg;
+		std::size_t jump, src, len;
 
-	void drawdeck(int y, int x, int w, bool redraw = true)
+		op(opcode c, long a, std::size_t s, std::size_t l = 1) : code{c}, arg{a}, jump{npos}, src{s}, len{l} { }
+		op() = default;
+	};
+
+	struct super // Fused run of + - < > ops; arg of an op_super indexes supers
 	{
-		static int ldiff = -1;
-		static std::size_t old_p = 0, old_offset = 0;
-		offset += p - old_p;
-		int n = (w - 1) / 4;
-		if (offset == 0) offset = n / 2;
-		else if (offset < 2) offset = 2;
-		else if (offset >= n - 2) offset = n - 3;
-		if (redraw) ldiff = curses::tape(y, x, w, offset, 3);
-		else ldiff = curses::tape(y, x, w, offset, 3, old_offset);
-		if (old_p != p || redraw) for (int i = 0; i < n; i++)
-		{
-			int idx = ((int) p) - offset + i;
-			char cmd = (idx < 0 || idx >= deck.size()) ? ' ' : deck[idx];
-			curses::move(y + 1, x + 2 + ldiff + i * 4);
-			out << cmd;
-		}
-		old_p = p;
-		old_offset = offset;
-	}
+		std::vector<std::pair<long, long>> cells; // Offset from the pointer on entry and amount to add
+		long net, lo, hi;
+	};
 
-	void drawstat(int y, int x, int h, int w, bool redraw = false)
+	struct span // Tape window touched by a loop or procedure body, relative to the pointer on entry
 	{
-		const int keyw = 26, valw = 8;
-		static const std::vector<std::string> names{"Instructions executed", "Deck size", "Instruction pointer", "Tape position", "Procedures defined", "Current procedure"};
-		std::vector<std::string> values{util::t2s(cnt), util::t2s(deck.size()), util::t2s(p), util::t2s(t.posn()), util::t2s(pt.size()), pt.cur == -1 ? "-" : util::t2s(pt.cur)};
-		if (redraw)
+		long lo, hi, net;
+		bool bounded, pure; // Whether the window is statically known, and whether the body also has no other side effects
+	};
+
+	struct header // Followed by the deck, then LEB128-encoded ops and supers
+	{
+		char magic[4];
+		uint32_t version, flags, reserved;
+		uint64_t hash, decklen, nops, nsupers, check; // check hashes everything after the deck
+	};
+
+	static const std::size_t npos = (std::size_t) -1;
+	static const uint32_t version = 4;
+	static const std::size_t max_super = 8;
+
+	std::vector<op> ops;
+	std::vector<super> supers;
+	std::vector<span> spans; // Indexed by op; only meaningful for [ and ( ops
+
+	void compile(const std::string &deck)
+	{
+		ops.clear();
+		supers.clear();
+		std::stack<std::size_t> open;
+		for (std::size_t i = 0; i < deck.size(); i++)
 		{
-			curses::attr_on(36);
-			for (int i = 0; i < names.size(); i++)
+			char c = deck[i];
+			switch (c)
 			{
-				curses::move(y + i % h, x + (i / h) * (keyw + valw));
-				out << names[i] << ":";
+				case '+': case '-': case '<': case '>':
+				{
+					bool move = (c == '<' || c == '>');
+					std::size_t start = i;
+					long arg = 0;
+					for (; i < deck.size(); i++)
+					{
+						if (deck[i] == '+' && ! move) arg++;
+						else if (deck[i] == '-' && ! move) arg--;
+						else if (deck[i] == '>' && move) arg++;
+						else if (deck[i] == '<' && move) arg--;
+						else break;
+					}
+					i--;
+					ops.push_back(op{move ? op_move : op_add, arg, start, i - start + 1});
+					break;
+				}
+				case '[':
+					if (i + 2 < deck.size() && (deck[i + 1] == '-' || deck[i + 1] == '+') && deck[i + 2] == ']')
+					{
+						ops.push_back(op{op_clear, deck[i + 1] == '+' ? 1 : -1, i, 3});
+						i += 2;
+						break;
+					}
+				case '(':
+					open.push(ops.size());
+					ops.push_back(op{c == '[' ? op_jz : op_def, 0, i});
+					break;
+				case ']': case ')':
+				{
+					if (open.empty())
+					{
+						if (c == ']') throw std::runtime_error{"Unmatched \"]\""};
+						ops.push_back(op{op_ret, 0, i}); // Stray returns are no-ops at the top level
+						break;
+					}
+					std::size_t start = open.top();
+					open.pop();
+					if (ops[start].code != (c == ']' ? op_jz : op_def)) throw std::runtime_error{"Deck is not properly nested"};
+					ops.push_back(op{c == ']' ? op_jnz : op_ret, 0, i});
+					ops[start].jump = ops.size() - 1;
+					ops.back().jump = start;
+					break;
+				}
+				case ',': ops.push_back(op{op_in, 0, i}); break;
+				case '.': ops.push_back(op{op_out, 0, i}); break;
+				case ':': ops.push_back(op{op_call, 0, i}); break;
+				case '!': ops.push_back(op{op_stop, 0, i}); break;
+				case '?': ops.push_back(op{op_posn, 0, i}); break;
+				case '=': ops.push_back(op{op_num, 0, i}); break;
+				case '%': ops.push_back(op{op_nl, 0, i}); break;
+				default: break;
 			}
-			curses::attr_reset();
-		}
-		for (int i = 0; i < values.size(); i++)
-		{
-			curses::move(y + i % h, x + (i / h) * (keyw + valw) + keyw);
-			for (int j = 0; j < valw; j++) out << " ";
-			curses::move(y + i % h, x + (i / h) * (keyw + valw) + keyw);
-			out << values[i];
 		}
+		if (! open.empty()) throw std::runtime_error{std::string{"Unmatched \""} + deck[ops[open.top()].src] + "\""};
+		analyze();
 	}
 
-	void reset()
+	void analyze()
 	{
-		t.reset();
-		pt.reset();
-		inbox.reset();
-		outbox.reset();
-		deck = "";
+		struct frame
+		{
+			std::size_t start;
+			long off, lo, hi;
+			bool bounded, pure;
+
+			void touch() { lo = std::min(lo, off); hi = std::max(hi, off); }
+		};
+		spans.assign(ops.size(), span{0, 0, 0, false, false});
+		std::vector<frame> stack{frame{npos, 0, 0, 0, true, true}};
+		for (std::size_t i = 0; i < ops.size(); i++)
+		{
+			frame &f = stack.back();
+			switch (ops[i].code)
+			{
+				case op_add: case op_clear: f.touch(); break;
+				case op_move: f.off += ops[i].arg; break;
+				case op_super:
+				{
+					const super &s = supers[ops[i].arg];
+					f.lo = std::min(f.lo, f.off + s.lo);
+					f.hi = std::max(f.hi, f.off + s.hi);
+					f.off += s.net;
+					break;
+				}
+				case op_in: case op_out: case op_num: f.touch(); f.pure = false; break;
+				case op_posn: case op_nl: case op_stop: f.pure = false; break;
+				case op_call: f.touch(); f.bounded = f.pure = false; break; // Callee is only known at runtime
+				case op_jz: case op_def:
+					f.touch();
+					if (ops[i].code == op_def) f.pure = false;
+					stack.push_back(frame{i, 0, 0, 0, true, true});
+					break;
+				case op_jnz: case op_ret:
+				{
+					if (ops[i].jump == npos) { f.pure = false; break; } // Stray top-level return
+					bool loop = ops[i].code == op_jnz;
+					if (loop) f.touch();
+					span s{f.lo, f.hi, f.off, f.bounded && (! loop || f.off == 0), f.bounded && f.pure && (! loop || f.off == 0)};
+					spans[f.start] = s;
+					stack.pop_back();
+					frame &parent = stack.back();
+					if (! loop) break; // Definitions don't run their body in place
+					if (! s.bounded) parent.bounded = parent.pure = false;
+					else
+					{
+						parent.lo = std::min(parent.lo, parent.off + s.lo);
+						parent.hi = std::max(parent.hi, parent.off + s.hi);
+						parent.pure = parent.pure && s.pure;
+					}
+					break;
+				}
+			}
+		}
+	}
+
+	std::size_t find(std::size_t src) const // Index of the op starting at deck position src, or npos
+	{
+		std::size_t lo = 0, hi = ops.size();
+		while (lo < hi)
+		{
+			std::size_t mid = lo + (hi - lo) / 2;
+			if (ops[mid].src < src) lo = mid + 1;
+			else hi = mid;
+		}
+		if (lo == ops.size() || ops[lo].src == src) return lo;
+		return npos;
+	}
+
+	std::string pattern(std::size_t i, std::size_t len) const // Text form of a run of + - < > ops, as used in PGO profiles
+	{
+		std::string ret{};
+		for (std::size_t j = i; j < i + len; j++) ret += (j == i ? "" : ",") + std::string{ops[j].code == op_add ? "a" : "m"} + util::t2s(ops[j].arg);
+		return ret;
+	}
+
+	bool straight(std::size_t i) const { return i < ops.size() && (ops[i].code == op_add || ops[i].code == op_move); }
+
+	std::vector<std::pair<unsigned long, std::string>> hot(const std::vector<unsigned long> &counts, std::size_t n) const // Most dispatch-saving op sequences
+	{
+		std::map<std::string, unsigned long> weight{};
+		for (std::size_t i = 0; i < ops.size(); )
+		{
+			std::size_t len = 0;
+			while (len < max_super && straight(i + len)) len++;
+			if (len >= 2 && i < counts.size()) weight[pattern(i, len)] += counts[i] * (len - 1);
+			i += len ? len : 1;
+		}
+		std::vector<std::pair<unsigned long, std::string>> ret{};
+		for (const std::pair<const std::string, unsigned long> &w : weight) if (w.second) ret.push_back(std::make_pair(w.second, w.first));
+		std::sort(ret.rbegin(), ret.rend());
+		if (ret.size() > n) ret.resize(n);
+		return ret;
+	}
+
+	static void bound(super &s)
+	{
+		s.lo = s.hi = 0;
+		for (const std::pair<long, long> &c : s.cells) { s.lo = std::min(s.lo, c.first); s.hi = std::max(s.hi, c.first); }
+	}
+
+	std::size_t fuse(const std::vector<std::string> &patterns) // Replace occurrences of the given sequences with superinstructions; returns the number replaced
+	{
+		std::map<std::string, std::size_t> chosen{};
+		std::vector<op> fused{};
+		std::vector<std::size_t> remap(ops.size() + 1);
+		std::size_t count = 0;
+		for (std::size_t i = 0; i < ops.size(); )
+		{
+			std::size_t len = 0;
+			while (len < max_super && straight(i + len)) len++;
+			if (len < 2 || std::find(patterns.begin(), patterns.end(), pattern(i, len)) == patterns.end())
+			{
+				for (std::size_t j = i; j < i + (len ? len : 1); j++)
+				{
+					remap[j] = fused.size();
+					fused.push_back(ops[j]);
+				}
+				i += len ? len : 1;
+				continue;
+			}
+			std::string pat = pattern(i, len);
+			if (! chosen.count(pat))
+			{
+				super s{};
+				long off = 0;
+				for (std::size_t j = i; j < i + len; j++)
+				{
+					if (ops[j].code == op_move) off += ops[j].arg;
+					else s.cells.push_back(std::make_pair(off, ops[j].arg));
+				}
+				s.net = off;
+				bound(s);
+				chosen[pat] = supers.size();
+				supers.push_back(s);
+			}
+			std::size_t cnt = 0;
+			for (std::size_t j = i; j < i + len; j++)
+			{
+				remap[j] = fused.size();
+				cnt += ops[j].len;
+			}
+			fused.push_back(op{op_super, (long) chosen[pat], ops[i].src, cnt});
+			count++;
+			i += len;
+		}
+		for (op &o : fused) if (o.jump != npos) o.jump = remap[o.jump];
+		ops.swap(fused);
+		analyze();
+		return count;
+	}
+
+	static void put(std::string &out, uint64_t v) // Unsigned LEB128
+	{
+		for (; v >= 0x80; v >>= 7) out += (char) (v | 0x80);
+		out += (char) v;
+	}
+
+	static uint64_t zig(long v) { return ((uint64_t) v << 1) ^ (uint64_t) (v >> 63); }
+
+	static long unzig(uint64_t v) { return (long) (v >> 1) ^ -(long) (v & 1); }
+
+	struct reader // Bounds-checked LEB128 decoding; ok turns false on the first overrun
+	{
+		const unsigned char *pos, *end;
+		bool ok;
+
+		uint64_t get()
+		{
+			uint64_t v = 0;
+			for (int shift = 0; ok; shift += 7)
+			{
+				if (pos == end || shift > 63) break;
+				unsigned char b = *pos++;
+				v |= (uint64_t) (b & 0x7f) << shift;
+				if (! (b & 0x80)) return v;
+			}
+			ok = false;
+			return 0;
+		}
+	};
+
+	bool valid(std::size_t decklen) const // Indices in a loaded program are in range, brackets nest properly and no offset exceeds the deck length
+	{
+		long most = decklen;
+		std::stack<std::size_t> open{};
+		for (const super &s : supers) if (s.lo < -most || s.hi > most || s.net < -most || s.net > most) return false;
+		for (std::size_t i = 0; i < ops.size(); i++)
+		{
+			const op &o = ops[i];
+			if (o.code > op_super || o.src >= decklen || o.len > decklen - o.src || o.arg < -most || o.arg > most) return false;
+			if (o.code == op_super && (o.arg < 0 || (std::size_t) o.arg >= supers.size())) return false;
+			if (o.code == op_ret && o.jump == npos && open.empty()) continue; // Stray top-level return
+			if (o.code == op_jz || o.code == op_def)
+			{
+				if (o.jump >= ops.size() || o.jump <= i || ops[o.jump].code != (o.code == op_jz ? op_jnz : op_ret) || ops[o.jump].jump != i) return false;
+				open.push(i);
+			}
+			else if (o.code == op_jnz || o.code == op_ret)
+			{
+				if (open.empty() || open.top() != o.jump) return false;
+				open.pop();
+			}
+			else if (o.jump != npos) return false;
+		}
+		return open.empty();
+	}
+
+	bool load(const std::string &path, uint64_t hash, uint32_t flags, std::string &deck)
+	{
+		int fd = open(path.c_str(), O_RDONLY);
+		if (fd < 0) return false;
+		struct stat st;
+		if (fstat(fd, &st) != 0 || (std::size_t) st.st_size < sizeof(header))
+		{
+			close(fd);
+			return false;
+		}
+		void *map = mmap(0, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+		close(fd);
+		if (map == MAP_FAILED) return false;
+		const char *base = (const char *) map;
+		const header *h = (const header *) base;
+		std::size_t size = st.st_size, body = sizeof(header) + h->decklen;
+		bool ok = std::string{h->magic, 4} == std::string{"PBC", 4} && h->version == version && h->flags == flags && h->hash == hash
+			&& h->decklen <= size - sizeof(header) && h->nops <= size - body && h->nsupers <= size - body // Every op and super takes at least a byte
+			&& h->check == util::hash(std::string{base + body, size - body});
+		if (ok)
+		{
+			reader in{(const unsigned char *) base + body, (const unsigned char *) base + size, true};
+			ops.resize(h->nops);
+			for (std::size_t i = 0, next = 0; i < ops.size() && in.ok; i++)
+			{
+				op &o = ops[i];
+				o.code = (opcode) std::min<uint64_t>(in.get(), 0xff);
+				o.arg = unzig(in.get());
+				uint64_t jump = in.get();
+				o.jump = jump ? i + unzig(jump) : npos;
+				o.src = next + unzig(in.get());
+				o.len = in.get();
+				next = o.src + o.len;
+			}
+			supers.assign(h->nsupers, super{});
+			for (super &s : supers)
+			{
+				uint64_t n = in.get();
+				if (! in.ok || n > (std::size_t) (in.end - in.pos)) break;
+				s.net = unzig(in.get());
+				for (uint64_t j = 0; j < n && in.ok; j++)
+				{
+					long off = unzig(in.get());
+					s.cells.push_back(std::make_pair(off, unzig(in.get())));
+				}
+				bound(s);
+			}
+			ok = in.ok && in.pos == in.end && valid(h->decklen);
+			if (ok)
+			{
+				deck.assign(base + sizeof(header), h->decklen);
+				analyze(); // Spans decide where bounds checks are skipped, so they are never taken from the file
+			}
+			else
+			{
+				ops.clear();
+				supers.clear();
+			}
+		}
+		munmap(map, st.st_size);
+		return ok;
+	}
+
+	void save(const std::string &path, uint64_t hash, uint32_t flags, const std::string &deck) const
+	{
+		std::string body{};
+		for (std::size_t i = 0, next = 0; i < ops.size(); i++) // Jumps and sources are stored relative to where they usually are
+		{
+			const op &o = ops[i];
+			put(body, o.code);
+			put(body, zig(o.arg));
+			put(body, o.jump == npos ? 0 : zig(o.jump - i)); // A jump never targets its own op, so 0 is free for npos
+			put(body, zig(o.src - next));
+			put(body, o.len);
+			next = o.src + o.len;
+		}
+		for (const super &s : supers)
+		{
+			put(body, s.cells.size());
+			put(body, zig(s.net));
+			for (const std::pair<long, long> &c : s.cells) { put(body, zig(c.first)); put(body, zig(c.second)); }
+		}
+		header h{};
+		memset(&h, 0, sizeof(h));
+		memcpy(h.magic, "PBC", 4);
+		h.version = version;
+		h.flags = flags;
+		h.hash = hash;
+		h.decklen = deck.size();
+		h.nops = ops.size();
+		h.nsupers = supers.size();
+		h.check = util::hash(body);
+		std::string tmp = path + ".tmp";
+		std::ofstream out{tmp, std::ios::binary};
+		if (out.fail()) return; // The cache is best-effort
+		out.write((const char *) &h, sizeof(h));
+		out.write(deck.data(), deck.size());
+		out.write(body.data(), body.size());
+		out.close();
+		if (out.fail() || rename(tmp.c_str(), path.c_str()) != 0) unlink(tmp.c_str());
+	}
+};
+
+const std::size_t program::npos;
+
+namespace native
+{
+	const unsigned int version = 1; // Bump whenever the emitted C changes
+	const std::string prelude = R"(#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <termios.h>
+
+static unsigned char *mem;
+static long cap, origin, p;
+static int ptab[256];
+static FILE *in;
+static int tty;
+static struct termios ios_default, ios_raw;
+
+#define C mem[origin + p]
+
+static void grow(void)
+{
+	long need = origin + p < 0 ? -(origin + p) : origin + p - cap + 1;
+	long ncap = cap * 2 > cap + 2 * need ? cap * 2 : cap + 2 * need;
+	long norigin = origin + (ncap - cap) / 2;
+	unsigned char *nmem = calloc(ncap, 1);
+	if (! nmem) { fputs("Out of memory\n", stderr); exit(1); }
+	memcpy(nmem + norigin - origin, mem, cap);
+	free(mem);
+	mem = nmem;
+	cap = ncap;
+	origin = norigin;
+}
+
+#define MOVE(n) do { p += (n); if ((unsigned long) (origin + p) >= (unsigned long) cap) grow(); } while (0)
+
+static unsigned char readchar(void)
+{
+	if (tty) tcsetattr(STDIN_FILENO, TCSANOW, &ios_raw);
+	int c = getc(in);
+	if (tty) tcsetattr(STDIN_FILENO, TCSANOW, &ios_default);
+	return (unsigned char) c;
+}
+
+static void halt(void)
+{
+	fputs("\n\n", stdout);
+	exit(0);
+}
+
+static void call(void);
+)";
+
+	void emit_ops(const program &prog, std::size_t begin, std::size_t end, int depth, std::ostream &out, std::vector<std::string> &procs)
+	{
+		std::string ind(depth, '\t');
+		for (std::size_t i = begin; i < end; i++)
+		{
+			const program::op &o = prog.ops[i];
+			switch (o.code)
+			{
+				case program::op_add: out << ind << "C += " << o.arg << ";\n"; break;
+				case program::op_move: out << ind << "MOVE(" << o.arg << ");\n"; break;
+				case program::op_super:
+				{
+					long off = 0;
+					for (const std::pair<long, long> &c : prog.supers[o.arg].cells)
+					{
+						if (c.first != off) out << ind << "MOVE(" << c.first - off << ");\n";
+						out << ind << "C += " << c.second << ";\n";
+						off = c.first;
+					}
+					if (prog.supers[o.arg].net != off) out << ind << "MOVE(" << prog.supers[o.arg].net - off << ");\n";
+					break;
+				}
+				case program::op_clear: out << ind << "C = 0;\n"; break;
+				case program::op_in: out << ind << "C = readchar();\n"; break;
+				case program::op_out: out << ind << "putchar(C);\n"; break;
+				case program::op_jz:
+					out << ind << "while (C)\n" << ind << "{\n";
+					emit_ops(prog, i + 1, o.jump, depth + 1, out, procs);
+					out << ind << "}\n";
+					i = o.jump;
+					break;
+				case program::op_jnz: break;
+				case program::op_def:
+				{
+					std::size_t id = procs.size() + 1;
+					procs.push_back("");
+					std::ostringstream body{};
+					body << "static void proc_" << id << "(void)\n{\n";
+					emit_ops(prog, i + 1, o.jump, 1, body, procs);
+					body << "}\n\n";
+					procs[id - 1] = body.str();
+					out << ind << "ptab[C] = " << id << ";\n";
+					i = o.jump;
+					break;
+				}
+				case program::op_ret: break; // Only stray top-level returns reach here
+				case program::op_call: out << ind << "call();\n"; break;
+				case program::op_stop: out << ind << "halt();\n"; break;
+				case program::op_posn: out << ind << "printf(\"%ld\", p);\n"; break;
+				case program::op_num: out << ind << "printf(\"%d\", (int) (char) C);\n"; break;
+				case program::op_nl: out << ind << "putchar('\\n');\n"; break;
+			}
+		}
+	}
+
+	void emit(const program &prog, std::ostream &out)
+	{
+		std::vector<std::string> procs{};
+		std::ostringstream body{};
+		emit_ops(prog, 0, prog.ops.size(), 1, body, procs);
+		out << prelude << "\n";
+		for (const std::string &proc : procs) out << proc;
+		out << "static void call(void)\n{\n\tswitch (ptab[C])\n\t{\n";
+		for (std::size_t i = 1; i <= procs.size(); i++) out << "\t\tcase " << i << ": proc_" << i << "(); break;\n";
+		out << "\t\tdefault: break;\n\t}\n}\n\n";
+		out << "int main(int argc, char **argv)\n{\n";
+		out << "\tin = stdin;\n";
+		out << "\tif (argc > 1 && ! (in = fopen(argv[1], \"r\"))) { fprintf(stderr, \"Couldn't open input file %s\\n\", argv[1]); return 1; }\n";
+		out << "\ttty = (in == stdin && isatty(STDIN_FILENO));\n";
+		out << "\tif (tty) { tcgetattr(STDIN_FILENO, &ios_default); ios_raw = ios_default; ios_raw.c_lflag &= ~(ICANON | ECHO); }\n";
+		out << "\tcap = 4096;\n\torigin = cap / 2;\n\tmem = calloc(cap, 1);\n";
+		out << body.str();
+		out << "\thalt();\n\treturn 0;\n}\n";
+	}
+
+	std::vector<std::string> compiler() // $CC split into words, or cc
+	{
+		const char *cc = getenv("CC");
+		return util::split(cc && *cc ? cc : "cc", ' ');
+	}
+
+	// Run a command without a shell and wait for it, optionally sending its standard output to a file and killing it after some seconds; true if it exited with status 0
+	bool spawn(const std::vector<std::string> &args, const std::string &output = "", unsigned int limit = 0)
+	{
+		std::vector<char *> argv{};
+		for (const std::string &arg : args) argv.push_back(const_cast<char *>(arg.c_str()));
+		argv.push_back(nullptr);
+		pid_t pid = fork();
+		if (pid < 0) return false;
+		if (pid == 0)
+		{
+			if (output != "")
+			{
+				int fd = open(output.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+				if (fd < 0 || dup2(fd, STDOUT_FILENO) < 0) _exit(127);
+			}
+			if (limit) alarm(limit); // Survives the exec
+			execvp(argv[0], argv.data());
+			_exit(127);
+		}
+		int status;
+		while (waitpid(pid, &status, 0) < 0) if (errno != EINTR) return false;
+		return WIFEXITED(status) && WEXITSTATUS(status) == 0;
+	}
+
+	void build(const program &prog, const std::string &deck, const std::string &dest)
+	{
+		std::vector<std::string> args = compiler();
+		std::string salt = "native" + util::t2s(version);
+		for (const std::string &arg : args) salt += " " + arg;
+		std::string key = util::hash_hex(util::hash(deck, salt)); // A new emitter or compiler must not reuse an old binary
+		std::string dir = util::cachedir();
+		std::string src = dir + "/" + key + ".c", bin = dir + "/" + key + ".bin";
+		if (access(bin.c_str(), X_OK) != 0)
+		{
+			std::ofstream cfile{src};
+			if (cfile.fail()) throw std::runtime_error{"Couldn't write " + src};
+			emit(prog, cfile);
+			cfile.close();
+			args.insert(args.end(), {"-O2", "-o", bin, src});
+			if (! spawn(args)) throw std::runtime_error{"Compilation failed: " + args[0]};
+		}
+		util::copyfile(bin, dest);
+		chmod(dest.c_str(), 0755);
+	}
+}
+
+struct pool // Fixed set of worker threads that run one batch of jobs at a time
+{
+	std::vector<std::thread> workers;
+	std::mutex lock;
+	std::condition_variable wake, finished;
+	std::vector<std::function<void()>> jobs;
+	std::size_t next, pending;
+	bool stopping;
+
+	pool(unsigned int n) : workers{}, lock{}, wake{}, finished{}, jobs{}, next{0}, pending{0}, stopping{false}
+	{
+		for (unsigned int i = 0; i < n; i++) workers.push_back(std::thread{&pool::work, this});
+	}
+
+	~pool()
+	{
+		{
+			std::lock_guard<std::mutex> guard{lock};
+			stopping = true;
+		}
+		wake.notify_all();
+		for (std::thread &t : workers) t.join();
+	}
+
+	void work()
+	{
+		std::unique_lock<std::mutex> guard{lock};
+		while (true)
+		{
+			wake.wait(guard, [this] { return stopping || next < jobs.size(); });
+			if (stopping) return;
+			std::function<void()> job = jobs[next++];
+			guard.unlock();
+			job();
+			guard.lock();
+			if (--pending == 0) finished.notify_all();
+		}
+	}
+
+	void run(const std::vector<std::function<void()>> &batch) // Returns once every job in the batch has finished
+	{
+		std::unique_lock<std::mutex> guard{lock};
+		jobs = batch;
+		next = 0;
+		pending = batch.size();
+		wake.notify_all();
+		finished.wait(guard, [this] { return pending == 0; });
+	}
+};
+
+struct perf // Hardware performance counters around the execution engine, where the kernel allows them
+{
+	struct counter
+	{
+		std::string name;
+		uint32_t type;
+		uint64_t config;
+		int fd;
+	};
+
+	std::vector<counter> counters;
+
+	perf() : counters{
+		{"Cycles", PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES, -1},
+		{"Instructions retired", PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS, -1},
+		{"Branch misses", PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES, -1},
+		{"L1 data misses", PERF_TYPE_HW_CACHE, PERF_COUNT_HW_CACHE_L1D | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16), -1},
+		{"LLC misses", PERF_TYPE_HW_CACHE, PERF_COUNT_HW_CACHE_LL | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16), -1}}
+	{
+		for (counter &c : counters)
+		{
+			struct perf_event_attr attr;
+			memset(&attr, 0, sizeof(attr));
+			attr.size = sizeof(attr);
+			attr.type = c.type;
+			attr.config = c.config;
+			attr.disabled = 1;
+			attr.exclude_kernel = 1;
+			attr.exclude_hv = 1;
+			c.fd = syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0);
+		}
+	}
+
+	~perf() { for (counter &c : counters) if (c.fd >= 0) close(c.fd); }
+
+	bool available() const
+	{
+		for (const counter &c : counters) if (c.fd >= 0) return true;
+		return false;
+	}
+
+	void start() { for (counter &c : counters) if (c.fd >= 0) ioctl(c.fd, PERF_EVENT_IOC_ENABLE, 0); }
+
+	void stop() { for (counter &c : counters) if (c.fd >= 0) ioctl(c.fd, PERF_EVENT_IOC_DISABLE, 0); }
+
+	std::string value(std::size_t i, unsigned long ops = 0) const // Counter total, or per interpreted op if ops is given
+	{
+		uint64_t val;
+		if (counters[i].fd < 0 || read(counters[i].fd, &val, sizeof(val)) != sizeof(val)) return "-";
+		if (! ops) return util::t2s(val);
+		std::ostringstream ss{};
+		ss << std::fixed << std::setprecision(2) << (double) val / ops;
+		return ss.str();
+	}
+
+	void report(std::ostream &out, unsigned long ops) const
+	{
+		if (! available())
+		{
+			out << "Performance counters unavailable (check /proc/sys/kernel/perf_event_paranoid)\n";
+			return;
+		}
+		out << "Counter                   Total       Per op\n";
+		for (std::size_t i = 0; i < counters.size(); i++)
+			out << std::left << std::setw(22) << counters[i].name << std::right << std::setw(12) << value(i) << "  " << std::setw(11) << value(i, ops) << "\n";
+	}
+};
+
+struct machine
+{
+	static const unsigned int hot_threshold = 1000;
+	static const std::size_t memo_limit = 1 << 16;
+	static const unsigned long parallel_threshold = 4096;
+
+	struct memo
+	{
+		std::string after;
+		unsigned long cnt;
+	};
+
+	struct pending_memo
+	{
+		bool active;
+		std::string key;
+		index_t base;
+		long lo, hi;
+		unsigned long cnt;
+		std::size_t depth;
+	};
+
+	std::string deck;
+	program prog;
+	bool compiled, compilable, hot;
+	std::map<std::size_t, unsigned int> heat; // Back-edge and call counts for the stepping tier
+	tape t;
+	ptable pt;
+	std::size_t p, offset;
+	unsigned long cnt;
+	std::istream &in;
+	std::ostream &out;
+	curses::iobox inbox, outbox;
+	bool memoize, profiling, counting;
+	perf *pf;
+	std::vector<unsigned long> opcounts; // Dispatches per op, when counting
+	trace *tr;
+	std::vector<unsigned long> prof_entries, prof_iters; // Per loop or procedure op, when profiling
+	std::unordered_map<std::string, memo> memos; // Results of pure procedure calls, keyed by procedure start and input window
+	pending_memo pending;
+	unsigned long memo_hits, memo_misses;
+	bool parallel; // Run consecutive calls to pure procedures on worker threads
+	unsigned long parallel_cost; // Instructions a procedure must have taken on its last call to be worth a thread
+	std::vector<unsigned long> cost; // Instructions taken by the last call to each procedure, when parallel
+	pool *workers;
+	unsigned int nworkers; // Size of the pool, or 0 for one thread per CPU
+
+	machine(std::istream &i, std::ostream &o = std::cout) : deck{}, prog{}, compiled{false}, compilable{true}, hot{false}, heat{}, t{}, pt{}, p{0}, offset{0}, cnt{0}, in{i}, out{o}, inbox{}, outbox{},
+		memoize{false}, profiling{false}, counting{false}, pf{0}, opcounts{}, tr{0}, prof_entries{}, prof_iters{}, memos{}, pending{}, memo_hits{0}, memo_misses{0},
+		parallel{false}, parallel_cost{parallel_threshold}, cost{}, workers{0}, nworkers{0} { }
+
+	~machine() { delete workers; }
+
+	void drawdeck(int y, int x, int w, bool redraw = true)
+	{
+		static int ldiff = -1;
+		static std::size_t old_p = 0, old_offset = 0;
+		offset += p - old_p;
+		int n = (w - 1) / 4;
+		if (offset == 0) offset = n / 2;
+		else if (offset < 2) offset = 2;
+		else if (offset >= n - 2) offset = n - 3;
+		if (redraw) ldiff = curses::tape(y, x, w, offset, 3);
+		else ldiff = curses::tape(y, x, w, offset, 3, old_offset);
+		if (old_p != p || redraw) for (int i = 0; i < n; i++)
+		{
+			int idx = ((int) p) - offset + i;
+			char cmd = (idx < 0 || idx >= deck.size()) ? ' ' : deck[idx];
+			curses::move(y + 1, x + 2 + ldiff + i * 4);
+			out << cmd;
+		}
+		old_p = p;
+		old_offset = offset;
+	}
+
+	void drawstat(int y, int x, int h, int w, bool redraw = false)
+	{
+		const int keyw = 26, valw = 8;
+		std::vector<std::string> names{"Instructions executed", "Deck size", "Instruction pointer", "Tape position", "Procedures defined", "Current procedure", "Memo hits", "Memo misses", "Tape memory (KiB)"};
+		std::vector<std::string> values{util::t2s(cnt), util::t2s(deck.size()), util::t2s(p), util::t2s(t.posn()), util::t2s(pt.size()), pt.cur == -1 ? "-" : util::t2s(pt.cur), util::t2s(memo_hits), util::t2s(memo_misses), util::t2s(t.rss / 1024)};
+		if (pf)
+		{
+			names.insert(names.end(), {"Cycles per op", "Branch misses per op", "L1 misses per op", "LLC misses per op"});
+			values.insert(values.end(), {pf->value(0, cnt), pf->value(2, cnt), pf->value(3, cnt), pf->value(4, cnt)});
+		}
+		while ((int) names.size() > h && (((int) names.size() - 1) / h + 1) * (keyw + valw) > w) // Drop columns that don't fit
+		{
+			names.pop_back();
+			values.pop_back();
+		}
+		if (redraw)
+		{
+			curses::attr_on(36);
+			for (int i = 0; i < names.size(); i++)
+			{
+				curses::move(y + i % h, x + (i / h) * (keyw + valw));
+				out << names[i] << ":";
+			}
+			curses::attr_reset();
+		}
+		for (int i = 0; i < values.size(); i++)
+		{
+			curses::move(y + i % h, x + (i / h) * (keyw + valw) + keyw);
+			for (int j = 0; j < valw; j++) out << " ";
+			curses::move(y + i % h, x + (i / h) * (keyw + valw) + keyw);
+			out << values[i];
+		}
+	}
+
+	void reset()
+	{
+		t.reset();
+		pt.reset();
+		inbox.reset();
+		outbox.reset();
+		deck = "";
+		compiled = false;
+		compilable = true;
+		hot = false;
+		heat.clear();
+		memos.clear();
+		pending.active = false;
+		memo_hits = memo_misses = 0;
 		cnt = 0;
 		p = 0;
 	}
 
-	std::size_t match(std::size_t idx)
+	std::size_t match(std::size_t idx)
+	{
+		int inc, stack = 0;
+		char cur = deck[idx], target;
+		switch (cur)
+		{
+			case '[': target = ']'; inc = 1; break;
+			case ']': target = '['; inc = -1; break;
+			case '(': target = ')'; inc = 1; break;
+			case ')': target = '('; inc = -1; break;
+			case '{': target = '}'; inc = 1; break;
+			case '}': target = '{'; inc = -1; break;
+			default: throw std::runtime_error{"Internal error: non-matchable symbol passed to match"};
+		}
+		for (std::size_t i = idx + inc; i < deck.size() && i >= 0; i += inc)
+		{
+			if (deck[i] == target)
+			{
+				if (stack == 0) return i;
+				else stack--;
+			}
+			else if (deck[i] == cur) stack++;
+		}
+		throw std::runtime_error{std::string{"Unmatched \""} + cur + "\""};
+	}
+
+	int step()
+	{
+		if (p >= deck.size()) return 1;
+		cnt++;
+		switch(deck[p])
+		{
+			// Standard BF
+			case '+': t.inc(); break;
+			case '-': t.dec(); break;
+			case '<': t.l(); break;
+			case '>': t.r(); break;
+			case ',': t.in(input()); break;
+			case '.': output(t.out()); break;
+			case '[': if (! t.get()) p = match(p);
+				  else if (tr) tr->loop(trace::loop_enter, p, cnt, t.p);
+				  break;
+			case ']': if (t.get()) { p = match(p); warm(p); if (tr) tr->loop(trace::loop_iter, p, cnt, t.p); if (interrupted) { p++; return 1; } }
+				  else if (tr) tr->loop(trace::loop_exit, match(p), cnt, t.p);
+				  break;
+			// Pbrain functions
+			case '(': pt.add(t.get(), p, deck.substr(p + 1, match(p) - p - 1)); p = match(p); break;
+			case ')': try { p = pt.pop(); memo_return(); }
+				  catch (std::runtime_error e) { } break;
+			case ':': { if (memoize && memo_call(t.get())) break;
+				  std::size_t start = pt.push(t.get(), p); if (start != p) warm(start); p = start; if (interrupted) { p++; return 1; } break; }
+			// Debugging extensions
+			case '!': p++; return 1;
+			case '?': out << t.posn(); break;
+			case '=': out << (int) t.out(); break;
+			case '%': out << "\n"; break;
+			default: break;
+		}
+		p++;
+		return 0;
+	}
+
+	char input()
+	{
+		char c;
+		if (&in != &std::cin) c = in.get();
+		else if (gui) { ionum = 2; c = inbox.in(); }
+		else c = curses::readchar();
+		if (tr) tr->put(trace::io_in, (unsigned char) c);
+		return c;
+	}
+
+	void output(char c)
+	{
+		if (tr) tr->put(trace::io_out, (unsigned char) c);
+		if (gui) outbox.out(c);
+		else if (&out != &std::cout) out.put(c);
+		else putc(c, stdout);
+	}
+
+	void warm(std::size_t header)
+	{
+		if (! compilable || gui) return; // Nothing will be promoted, so don't pay for the map
+		if (++heat[header] >= hot_threshold) hot = true;
+	}
+
+	bool memo_call(cell id) // Replay a recorded call to a pure procedure, or start recording one; returns true if the call was replayed
+	{
+		if (! pt.table.count(id) || pending.active) return false;
+		if (! compiled)
+		{
+			if (! compilable) return false;
+			try { prog.compile(deck); compiled = true; }
+			catch (std::runtime_error e) { compilable = false; return false; }
+		}
+		std::size_t def = prog.find(pt.table[id].start);
+		if (def == program::npos || ! prog.spans[def].pure) return false;
+		const program::span &s = prog.spans[def];
+		std::string key{(const char *) &pt.table[id].start, sizeof(std::size_t)};
+		for (index_t i = t.p + s.lo; i <= t.p + s.hi; i++) key += (char) *t.resolve(i);
+		std::unordered_map<std::string, memo>::iterator hit = memos.find(key);
+		if (hit != memos.end())
+		{
+			for (long i = 0; i <= s.hi - s.lo; i++) *t.resolve(t.p + s.lo + i) = hit->second.after[i];
+			t.p += s.net;
+			t.offset += s.net;
+			cnt += hit->second.cnt;
+			memo_hits++;
+			return true;
+		}
+		memo_misses++;
+		pending = pending_memo{true, key, t.p, s.lo, s.hi, cnt, pt.callstack.size()};
+		return false;
+	}
+
+	void memo_return()
+	{
+		if (! pending.active || pt.callstack.size() != pending.depth) return;
+		pending.active = false;
+		if (memos.size() >= memo_limit) memos.clear();
+		memo &m = memos[pending.key];
+		m.after.clear();
+		for (index_t i = pending.base + pending.lo; i <= pending.base + pending.hi; i++) m.after += (char) *t.resolve(i);
+		m.cnt = cnt - pending.cnt;
+	}
+
+	int run() // Step through cold code, switching to the compiled deck at the header of the first hot loop or procedure
+	{
+		while (! compiled)
+		{
+			if (step()) return 1;
+			if ((! hot && ! profiling) || ! compilable) continue;
+			try { prog.compile(deck); compiled = true; }
+			catch (std::runtime_error e) { compilable = false; } // Badly nested decks stay in the stepping tier
+			heat.clear();
+			hot = false;
+		}
+		return exec();
+	}
+
+	int bounded(std::size_t root) // Run the body of a loop or procedure whose tape window has already been reserved; returns 1 when stopped
+	{
+		const std::vector<program::op> &ops = prog.ops;
+		cell *mem = t.mem + t.origin;
+		index_t ptr = t.p;
+		std::size_t end = ops[root].jump;
+		if (profiling) prof_entries[root]++;
+		for (std::size_t i = root + 1; ; i++)
+		{
+			const program::op &o = ops[i];
+			if (counting) opcounts[i]++;
+			switch (o.code)
+			{
+				case program::op_add: mem[ptr] += o.arg; cnt += o.len; break;
+				case program::op_move: ptr += o.arg; cnt += o.len; break;
+				case program::op_super:
+				{
+					const program::super &s = prog.supers[o.arg];
+					for (const std::pair<long, long> &c : s.cells) mem[ptr + c.first] += c.second;
+					ptr += s.net;
+					cnt += o.len;
+					break;
+				}
+				case program::op_clear: cnt += 1 + 2 * (o.arg < 0 ? mem[ptr] : (256 - mem[ptr]) % 256); mem[ptr] = 0; break;
+				case program::op_in: cnt++; mem[ptr] = input(); break;
+				case program::op_out: cnt++; output(mem[ptr]); break;
+				case program::op_jz:
+					cnt++;
+					if (! mem[ptr]) i = o.jump;
+					else
+					{
+						if (profiling) prof_entries[i]++;
+						if (tr) tr->loop(trace::loop_enter, o.src, cnt, ptr);
+					}
+					break;
+				case program::op_jnz:
+					cnt++;
+					if (mem[ptr])
+					{
+						i = o.jump;
+						if (profiling) prof_iters[i]++;
+						if (tr) tr->loop(trace::loop_iter, ops[i].src, cnt, ptr);
+						if (interrupted) // Resume in the checked tier at the top of the body
+						{
+							t.offset += ptr - t.p;
+							t.p = ptr;
+							p = ops[i + 1].src;
+							return 1;
+						}
+						break;
+					}
+					if (tr) tr->loop(trace::loop_exit, ops[o.jump].src, cnt, ptr);
+					if (i == end)
+					{
+						t.offset += ptr - t.p;
+						t.p = ptr;
+						return 0;
+					}
+					break;
+				case program::op_def:
+					cnt++;
+					pt.add(mem[ptr], o.src, deck.substr(o.src + 1, ops[o.jump].src - o.src - 1));
+					i = o.jump;
+					break;
+				case program::op_ret: // Only the end of a bounded procedure
+					cnt++;
+					t.offset += ptr - t.p;
+					t.p = ptr;
+					return 0;
+				case program::op_stop:
+					cnt++;
+					t.offset += ptr - t.p;
+					t.p = ptr;
+					p = o.src + 1;
+					return 1;
+				case program::op_posn: cnt++; out << ptr; break;
+				case program::op_num: cnt++; out << (int) (char) mem[ptr]; break;
+				case program::op_nl: cnt++; out << "\n"; break;
+				case program::op_call: break; // Bounded bodies never call
+			}
+		}
+	}
+
+	static unsigned long pure(const program &prog, std::size_t root, cell *mem) // Run a pure procedure body on its own slice of the tape; returns its instruction count, or ULONG_MAX if interrupted
+	{
+		const std::vector<program::op> &ops = prog.ops;
+		unsigned long cnt = 0;
+		index_t ptr = 0;
+		for (std::size_t i = root + 1; ; i++)
+		{
+			const program::op &o = ops[i];
+			switch (o.code)
+			{
+				case program::op_add: mem[ptr] += o.arg; cnt += o.len; break;
+				case program::op_move: ptr += o.arg; cnt += o.len; break;
+				case program::op_super:
+				{
+					const program::super &s = prog.supers[o.arg];
+					for (const std::pair<long, long> &c : s.cells) mem[ptr + c.first] += c.second;
+					ptr += s.net;
+					cnt += o.len;
+					break;
+				}
+				case program::op_clear: cnt += 1 + 2 * (o.arg < 0 ? mem[ptr] : (256 - mem[ptr]) % 256); mem[ptr] = 0; break;
+				case program::op_jz: cnt++; if (! mem[ptr]) i = o.jump; break;
+				case program::op_jnz:
+					cnt++;
+					if (! mem[ptr]) break;
+					if (interrupted) return ULONG_MAX;
+					i = o.jump;
+					break;
+				case program::op_ret: return cnt + 1;
+				default: return cnt; // Pure bodies contain nothing else
+			}
+		}
+	}
+
+	std::size_t speculate(std::size_t first) // Run a run of calls to pure procedures with disjoint windows concurrently; returns the last op covered, or npos if there was nothing to run in parallel
+	{
+		struct task
+		{
+			cell id;
+			std::size_t src, def;
+			index_t at, lo, hi; // Entry cell and the window the call reads and writes, id cell included
+			std::string saved;
+			unsigned long cnt;
+		};
+		const std::vector<program::op> &ops = prog.ops;
+		std::vector<task> batch{};
+		index_t ptr = t.p, end = t.p; // Scanning position, and where the pointer is after the last call in the batch
+		unsigned long moves = 0;
+		std::size_t last = program::npos;
+		for (std::size_t i = first; i < ops.size(); i++)
+		{
+			if (ops[i].code == program::op_move)
+			{
+				ptr += ops[i].arg;
+				continue;
+			}
+			if (ops[i].code != program::op_call) break;
+			cell id = t.peek(ptr);
+			std::map<cell, ptable::pinfo>::iterator proc = pt.table.find(id);
+			if (proc == pt.table.end()) break;
+			std::size_t def = prog.find(proc->second.start);
+			if (def == program::npos || ! prog.spans[def].pure || (parallel_cost && (cost.size() != ops.size() || cost[def] < parallel_cost))) break;
+			const program::span &s = prog.spans[def];
+			task next{id, ops[i].src, def, ptr, ptr + s.lo, ptr + s.hi, "", 0};
+			bool overlap = false;
+			for (const task &prev : batch) if (next.lo <= prev.hi && prev.lo <= next.hi) overlap = true;
+			if (overlap) break; // Order would matter, so this call runs after the batch
+			batch.push_back(next);
+			for (std::size_t j = last == program::npos ? first : last + 1; j < i; j++) moves += ops[j].len;
+			ptr += s.net;
+			end = ptr;
+			last = i;
+		}
+		if (batch.size() < 2) return program::npos;
+		std::vector<std::function<void()>> jobs{};
+		for (task &k : batch)
+		{
+			t.reserve(k.lo, k.hi);
+			k.saved.assign((const char *) t.mem + t.origin + k.lo, k.hi - k.lo + 1);
+		}
+		cell *mem = t.mem + t.origin; // Stable from here on, since every window is reserved
+		for (task &k : batch) jobs.push_back([&k, mem, this] { k.cnt = pure(prog, k.def, mem + k.at); });
+		if (! workers) workers = new pool{nworkers ? nworkers : std::max(2u, std::thread::hardware_concurrency())};
+		workers->run(jobs);
+		for (const task &k : batch) if (k.cnt == ULONG_MAX) // Interrupted: undo everything so the first call can be retried
+		{
+			for (const task &r : batch) memcpy(mem + r.lo, r.saved.data(), r.saved.size());
+			return program::npos;
+		}
+		for (const task &k : batch) // Commit in program order
+		{
+			pt.push(k.id, k.src);
+			pt.pop();
+			cnt += 1 + k.cnt;
+		}
+		cnt += moves;
+		t.offset += end - t.p;
+		t.p = end;
+		return last;
+	}
+
+	void profile(std::ostream &dest) // Report how loops ran and which ones ran without bounds checks
+	{
+		std::vector<std::pair<unsigned long, std::size_t>> loops{};
+		for (std::size_t i = 0; i < prof_entries.size(); i++) if (prof_entries[i] && (prog.ops[i].code == program::op_jz || prog.ops[i].code == program::op_def))
+			loops.push_back(std::make_pair(prof_iters[i], i));
+		std::sort(loops.rbegin(), loops.rend());
+		dest << "Loop  Position  Entries  Iterations  Window  Checks\n";
+		for (const std::pair<unsigned long, std::size_t> &l : loops)
+		{
+			const program::span &s = prog.spans[l.second];
+			dest << (prog.ops[l.second].code == program::op_jz ? "[     " : "(     ") << std::setw(8) << prog.ops[l.second].src << "  " << std::setw(7) << prof_entries[l.second] << "  " << std::setw(10) << l.first << "  ";
+			if (s.bounded) dest << std::setw(6) << (util::t2s(s.lo) + ":" + util::t2s(s.hi)) << "  unchecked\n";
+			else dest << std::setw(6) << "-" << "  checked\n";
+		}
+	}
+
+	int exec() // Run the compiled deck to completion; returns 1 when stopped
+	{
+		if (! compiled)
+		{
+			prog.compile(deck);
+			compiled = true;
+		}
+		while (prog.find(p) == program::npos) if (step()) return 1;
+		if (profiling && prof_entries.size() != prog.ops.size())
+		{
+			prof_entries.assign(prog.ops.size(), 0);
+			prof_iters.assign(prog.ops.size(), 0);
+		}
+		if (counting && opcounts.size() != prog.ops.size()) opcounts.assign(prog.ops.size(), 0);
+		const std::vector<program::op> &ops = prog.ops;
+		std::vector<std::size_t> rets{};
+		std::size_t entry[256];
+		std::fill(entry, entry + 256, program::npos);
+		for (std::size_t i = prog.find(p); i < ops.size(); i++)
+		{
+			const program::op &o = ops[i];
+			if (counting) opcounts[i]++;
+			switch (o.code)
+			{
+				case program::op_add: *t.resolve(t.p) += o.arg; cnt += o.len; break;
+				case program::op_move: t.p += o.arg; t.offset += o.arg; cnt += o.len; break;
+				case program::op_super:
+				{
+					const program::super &s = prog.supers[o.arg];
+					t.reserve(t.p + s.lo, t.p + s.hi);
+					cell *mem = t.mem + t.origin + t.p;
+					for (const std::pair<long, long> &c : s.cells) mem[c.first] += c.second;
+					t.p += s.net;
+					t.offset += s.net;
+					cnt += o.len;
+					break;
+				}
+				case program::op_clear:
+				{
+					cell *c = t.resolve(t.p);
+					cnt += 1 + 2 * (o.arg < 0 ? *c : (256 - *c) % 256);
+					*c = 0;
+					break;
+				}
+				case program::op_in: cnt++; t.in(input()); break;
+				case program::op_out: cnt++; output(t.out()); break;
+				case program::op_jz:
+					cnt++;
+					if (! t.get())
+					{
+						i = o.jump;
+						break;
+					}
+					if (tr) tr->loop(trace::loop_enter, o.src, cnt, t.p);
+					if (prog.spans[i].bounded)
+					{
+						t.reserve(t.p + prog.spans[i].lo, t.p + prog.spans[i].hi);
+						if (bounded(i)) return 1;
+						i = o.jump;
+					}
+					else if (profiling) prof_entries[i]++;
+					break;
+				case program::op_jnz:
+					cnt++;
+					if (t.get())
+					{
+						i = o.jump;
+						if (profiling) prof_iters[i]++;
+						if (tr) tr->loop(trace::loop_iter, ops[i].src, cnt, t.p);
+						if (interrupted)
+						{
+							p = ops[i + 1].src;
+							return 1;
+						}
+					}
+					else if (tr) tr->loop(trace::loop_exit, ops[o.jump].src, cnt, t.p);
+					break;
+				case program::op_def:
+					cnt++;
+					entry[t.get()] = i;
+					pt.add(t.get(), o.src, deck.substr(o.src + 1, ops[o.jump].src - o.src - 1));
+					i = o.jump;
+					break;
+				case program::op_ret:
+				{
+					cnt++;
+					if (pt.callstack.empty()) break;
+					std::size_t ret = pt.pop();
+					memo_return();
+					if (rets.empty()) i = prog.find(ret);
+					else { i = rets.back(); rets.pop_back(); }
+					break;
+				}
+				case program::op_call:
+				{
+					if (interrupted)
+					{
+						p = o.src;
+						return 1;
+					}
+					if (parallel && ! profiling && ! counting && ! tr)
+					{
+						std::size_t last = speculate(i);
+						if (last != program::npos)
+						{
+							i = last;
+							break;
+						}
+						if (interrupted) // The batch was rolled back, so stop before its first call
+						{
+							p = o.src;
+							return 1;
+						}
+					}
+					cnt++;
+					cell id = t.get();
+					if (memoize && memo_call(id)) break;
+					std::size_t start = pt.push(id, o.src);
+					if (start == o.src) break;
+					if (entry[id] == program::npos || ops[entry[id]].src != start) entry[id] = prog.find(start);
+					if (prog.spans[entry[id]].bounded)
+					{
+						t.reserve(t.p + prog.spans[entry[id]].lo, t.p + prog.spans[entry[id]].hi);
+						unsigned long before = cnt;
+						if (bounded(entry[id])) return 1;
+						if (parallel)
+						{
+							if (cost.size() != ops.size()) cost.assign(ops.size(), 0);
+							cost[entry[id]] = cnt - before;
+						}
+						pt.pop();
+						memo_return();
+						break;
+					}
+					rets.push_back(i);
+					i = entry[id];
+					break;
+				}
+				case program::op_stop: cnt++; p = o.src + 1; return 1;
+				case program::op_posn: cnt++; out << t.posn(); break;
+				case program::op_num: cnt++; out << (int) t.out(); break;
+				case program::op_nl: cnt++; out << "\n"; break;
+			}
+		}
+		p = deck.size();
+		return 1;
+	}
+
+	void load(const std::string &program)
+	{
+		deck.insert(p, program);
+		compiled = false;
+		compilable = true;
+		heat.clear();
+		hot = false;
+		memos.clear();
+		pending.active = false;
+		//p = 0;
+	}
+};
+
+struct spmd // Runs one compiled deck over many inputs in lockstep, one SIMD lane per input
+{
+	typedef cell vec __attribute__((vector_size(16)));
+	static const std::size_t width = sizeof(vec);
+
+	struct frame
+	{
+		std::size_t saved, depth, jnz; // Offset of the enclosing mask in masks, callstack depth and ] op on entry
+		index_t exitptr; // Where lanes that already left the loop are waiting
+		bool exited;
+	};
+
+	const std::string &deck;
+	const program &prog;
+	std::size_t n, w, ip;
+	index_t p;
+	std::vector<vec> pos, neg, mask, live, masks;
+	std::vector<frame> frames;
+	std::vector<std::ifstream> in;
+	std::vector<std::string> outs;
+	std::vector<unsigned long> cnt;
+	std::vector<std::size_t> rets;
+	ptable pt;
+
+	spmd(const std::string &d, const program &pr, const std::vector<std::string> &inputs) : deck{d}, prog{pr}, n{inputs.size()}, w{(inputs.size() + width - 1) / width}, ip{0}, p{0},
+		pos{}, neg{}, mask{}, live{}, masks{}, frames{}, in{}, outs{inputs.size()}, cnt(inputs.size(), 0), rets{}, pt{}
+	{
+		for (const std::string &path : inputs)
+		{
+			in.emplace_back(path);
+			if (in.back().fail()) throw std::runtime_error{"Couldn't open input file " + path};
+		}
+		live.resize(w);
+		for (std::size_t l = 0; l < n; l++) lanes(live)[l] = 0xff;
+		mask = live;
+	}
+
+	static cell *lanes(std::vector<vec> &v) { return (cell *) v.data(); }
+
+	vec *row(index_t idx)
 	{
-		int inc, stack = 0;
-		char cur = deck[idx], target;
-		switch (cur)
+		std::vector<vec> *arr = &pos;
+		if (idx < 0) { arr = &neg; idx *= -1; }
+		if (arr->size() <= (idx + 1) * w) arr->resize((idx + 1) * w);
+		return &(*arr)[idx * w];
+	}
+
+	std::size_t count(std::vector<vec> &m)
+	{
+		std::size_t ret = 0;
+		for (std::size_t l = 0; l < n; l++) if (lanes(m)[l]) ret++;
+		return ret;
+	}
+
+	bool full() { return same(mask, live); }
+
+	static bool same(const std::vector<vec> &a, const std::vector<vec> &b) { return memcmp(a.data(), b.data(), a.size() * sizeof(vec)) == 0; }
+
+	bool uniform(cell &val) // Whether all active lanes hold the same value in the current cell
+	{
+		cell *r = (cell *) row(p), *m = lanes(mask);
+		bool found = false;
+		for (std::size_t l = 0; l < n; l++) if (m[l])
 		{
-			case '[': target = ']'; inc = 1; break;
-			case ']': target = '['; inc = -1; break;
-			case '(': target = ')'; inc = 1; break;
-			case ')': target = '('; inc = -1; break;
-			case '{': target = '}'; inc = 1; break;
-			case '}': target = '{'; inc = -1; break;
-			default: throw std::runtime_error{"Internal error: non-matchable symbol passed to match"};
+			if (found && r[l] != val) return false;
+			val = r[l];
+			found = true;
 		}
-		for (std::size_t i = idx + inc; i < deck.size() && i >= 0; i += inc)
+		return true;
+	}
+
+	void tick(unsigned long c)
+	{
+		cell *m = lanes(mask);
+		for (std::size_t l = 0; l < n; l++) if (m[l]) cnt[l] += c;
+	}
+
+	bool run() // Returns false if execution must continue lane by lane from the current state
+	{
+		const std::vector<program::op> &ops = prog.ops;
+		std::vector<vec> next(w);
+		std::size_t entry[256];
+		std::fill(entry, entry + 256, program::npos);
+		for (; ip < ops.size(); ip++)
 		{
-			if (deck[i] == target)
+			const program::op &o = ops[ip];
+			switch (o.code)
 			{
-				if (stack == 0) return i;
-				else stack--;
+				case program::op_add:
+				{
+					vec *r = row(p);
+					for (std::size_t k = 0; k < w; k++) r[k] += mask[k] & (cell) o.arg;
+					tick(o.len);
+					break;
+				}
+				case program::op_move: p += o.arg; tick(o.len); break;
+				case program::op_super:
+					for (const std::pair<long, long> &c : prog.supers[o.arg].cells)
+					{
+						vec *r = row(p + c.first);
+						for (std::size_t k = 0; k < w; k++) r[k] += mask[k] & (cell) c.second;
+					}
+					p += prog.supers[o.arg].net;
+					tick(o.len);
+					break;
+				case program::op_clear:
+				{
+					cell *r = (cell *) row(p), *m = lanes(mask);
+					for (std::size_t l = 0; l < n; l++) if (m[l])
+					{
+						cnt[l] += 1 + 2 * (o.arg < 0 ? r[l] : (256 - r[l]) % 256);
+						r[l] = 0;
+					}
+					break;
+				}
+				case program::op_in:
+				{
+					cell *r = (cell *) row(p), *m = lanes(mask);
+					for (std::size_t l = 0; l < n; l++) if (m[l]) r[l] = in[l].get();
+					tick(1);
+					break;
+				}
+				case program::op_out: case program::op_posn: case program::op_num: case program::op_nl:
+				{
+					cell *r = (cell *) row(p), *m = lanes(mask);
+					for (std::size_t l = 0; l < n; l++) if (m[l])
+					{
+						if (o.code == program::op_out) outs[l] += (char) r[l];
+						else if (o.code == program::op_posn) outs[l] += util::t2s(p);
+						else if (o.code == program::op_num) outs[l] += util::t2s((int) (char) r[l]);
+						else outs[l] += "\n";
+					}
+					tick(1);
+					break;
+				}
+				case program::op_jz:
+				{
+					vec *r = row(p);
+					for (std::size_t k = 0; k < w; k++) next[k] = mask[k] & (vec) (r[k] != 0);
+					tick(1);
+					if (count(next) == 0) { ip = o.jump; break; }
+					frames.push_back(frame{masks.size(), pt.callstack.size(), o.jump, p, ! same(next, mask)});
+					masks.insert(masks.end(), mask.begin(), mask.end());
+					mask.swap(next);
+					break;
+				}
+				case program::op_jnz:
+				{
+					frame &f = frames.back();
+					vec *r = row(p);
+					for (std::size_t k = 0; k < w; k++) next[k] = mask[k] & (vec) (r[k] != 0);
+					std::size_t active = count(next);
+					bool leaving = ! same(next, mask);
+					if ((leaving || active == 0) && f.exited && p != f.exitptr) return false; // Pointer skew between lanes
+					if (active && active * 4 < n) return false; // Too divergent to be worth running in lockstep
+					tick(1);
+					if (leaving) { f.exitptr = p; f.exited = true; }
+					if (active == 0)
+					{
+						mask.assign(masks.begin() + f.saved, masks.begin() + f.saved + w);
+						masks.resize(f.saved);
+						frames.pop_back();
+					}
+					else
+					{
+						mask.swap(next);
+						ip = o.jump;
+						if (interrupted) return true;
+					}
+					break;
+				}
+				case program::op_def:
+				{
+					cell id = 0;
+					if (! full() || ! uniform(id)) return false;
+					tick(1);
+					entry[id] = ip;
+					pt.add(id, o.src, deck.substr(o.src + 1, ops[o.jump].src - o.src - 1));
+					ip = o.jump;
+					break;
+				}
+				case program::op_call:
+				{
+					cell id = 0;
+					if (interrupted) return true;
+					if (! uniform(id)) return false;
+					tick(1);
+					std::size_t start = pt.push(id, o.src);
+					if (start == o.src) break;
+					if (entry[id] == program::npos || ops[entry[id]].src != start) entry[id] = prog.find(start);
+					rets.push_back(ip);
+					ip = entry[id];
+					break;
+				}
+				case program::op_ret:
+					tick(1);
+					if (pt.callstack.empty()) break;
+					{
+						std::size_t ret = pt.pop();
+						if (rets.empty()) ip = prog.find(ret);
+						else { ip = rets.back(); rets.pop_back(); }
+					}
+					break;
+				case program::op_stop:
+					if (! full()) return false;
+					tick(1);
+					return true;
 			}
-			else if (deck[i] == cur) stack++;
 		}
-		throw std::runtime_error{std::string{"Unmatched \""} + cur + "\""};
+		return true;
 	}
 
-	int step()
+	void finish(std::size_t l, bool scalar) // Print a lane's output, first running it to completion on its own if needed
 	{
-		if (p >= deck.size()) return 1;
-		cnt++;
-		switch(deck[p])
+		std::cout << outs[l] << std::flush;
+		if (scalar)
 		{
-			// Standard BF
-			case '+': t.inc(); break;
-			case '-': t.dec(); break;
-			case '<': t.l(); break;
-			case '>': t.r(); break;
-			case ',': if (&in != &std::cin) t.in(in.get());
-				  else if (gui) { ionum = 2; t.in(inbox.in()); }
-				  else t.in(curses::readchar()); break;
-			case '.': if (gui) outbox.out(t.out());
-				  else putc(t.out(), stdout); break;
-			case '[': if (! t.get()) p = match(p); break;
-			case ']': if (t.get()) p = match(p); break;
-			// Pbrain functions
-			case '(': pt.add(t.get(), p, deck.substr(p + 1, match(p) - p - 1)); p = match(p); break;
-			case ')': try { p = pt.pop(); }
-				  catch (std::runtime_error e) { } break;
-			case ':': p = pt.push(t.get(), p); break;
-			// Debugging extensions
-			case '!': p++; return 1;
-			case '?': out << t.posn(); break;
-			case '=': out << (int) t.out(); break;
-			case '%': out << "\n"; break;
-			default: break;
+			machine m{in[l]};
+			m.deck = deck;
+			m.prog = prog;
+			m.compiled = true;
+			m.cnt = cnt[l];
+			m.pt = pt;
+			std::size_t depth = pt.callstack.size();
+			m.p = ops_src(ip);
+			m.t.p = p;
+			if (! lanes(mask)[l]) for (std::size_t i = frames.size(); i-- > 0; ) if (lanes(masks)[frames[i].saved * width + l])
+			{
+				m.p = ops_src(frames[i].jnz) + 1;
+				m.t.p = frames[i].exitptr;
+				depth = frames[i].depth;
+				break;
+			}
+			while (m.pt.callstack.size() > depth) m.pt.callstack.pop();
+			m.pt.cur = m.pt.callstack.empty() ? -1 : m.pt.callstack.top().id;
+			for (index_t idx = 0; (std::size_t) idx < pos.size() / w; idx++) *m.t.resolve(idx) = ((cell *) row(idx))[l];
+			for (index_t idx = 1; (std::size_t) idx < neg.size() / w; idx++) *m.t.resolve(-idx) = ((cell *) row(-idx))[l];
+			m.exec();
 		}
-		p++;
-		return 0;
+		std::cout << "\n\n";
 	}
 
-	void load(const std::string &program)
+	std::size_t ops_src(std::size_t i) { return i < prog.ops.size() ? prog.ops[i].src : deck.size(); }
+};
+
+struct verifier // Differential testing: runs decks through every engine and compares the resulting machine states
+{
+	enum engine { stepper, tiered, compiled, memoized, speculative, nengines };
+
+	struct outcome
 	{
-		deck.insert(p, program);
-		//p = 0;
+		std::string output, error, tape, procs;
+		index_t base, ptr;
+		unsigned long cnt;
+		std::size_t p;
+	};
+
+	static const unsigned long budget = 1 << 21; // Steps before a deck is assumed not to halt
+	static const unsigned int native_limit = 10; // Seconds a compiled deck may run, since the stepper already saw it halt
+	static const unsigned long report_interval = 1 << 16;
+
+	std::vector<std::string> corpus;
+	unsigned long cases;
+	std::atomic<unsigned long> next, done, skipped, failures;
+	std::mutex lock;
+
+	verifier(const std::vector<std::string> &decks, unsigned long n) : corpus{decks}, cases{n + decks.size()}, next{0}, done{0}, skipped{0}, failures{0}, lock{} { }
+
+	static const char *name(int e)
+	{
+		static const char *names[] = {"stepper", "tiered", "compiled", "memoized", "speculative"};
+		return names[e];
+	}
+
+	static outcome run(const std::string &deck, const std::string &input, int e)
+	{
+		std::istringstream in{input};
+		std::ostringstream out{};
+		machine m{in, out};
+		outcome ret{};
+		m.load(deck);
+		try
+		{
+			if (e == stepper)
+			{
+				while (! m.step()) if (m.cnt > budget)
+				{
+					ret.error = "budget";
+					break;
+				}
+			}
+			else if (e == tiered) m.run();
+			else
+			{
+				m.memoize = e == memoized;
+				m.parallel = e == speculative;
+				m.parallel_cost = 0;
+				m.nworkers = 2; // The verifier already runs a thread per CPU, so more would only oversubscribe them
+				m.exec();
+			}
+		}
+		catch (std::runtime_error err) { ret.error = err.what(); }
+		ret.output = out.str();
+		index_t lo = -m.t.origin, hi = m.t.len - m.t.origin - 1;
+		while (lo <= hi && ! m.t.mem[m.t.origin + lo]) lo++;
+		while (hi >= lo && ! m.t.mem[m.t.origin + hi]) hi--;
+		ret.base = lo <= hi ? lo : 0;
+		if (lo <= hi) ret.tape.assign((const char *) m.t.mem + m.t.origin + lo, hi - lo + 1);
+		ret.ptr = m.t.p;
+		ret.cnt = m.cnt;
+		ret.p = m.p;
+		std::ostringstream procs{};
+		for (const std::pair<const cell, ptable::pinfo> &proc : m.pt.table) procs << (int) proc.first << "@" << proc.second.start << "+" << proc.second.length << " ";
+		for (std::stack<ptable::stackp> s = m.pt.callstack; ! s.empty(); s.pop()) procs << "<" << (int) s.top().id << "@" << s.top().ret;
+		ret.procs = procs.str();
+		return ret;
+	}
+
+	static bool with_native() // Compiling every case with the C compiler is slow, so it only happens when $CC is set
+	{
+		const char *cc = getenv("CC");
+		return cc && *cc;
+	}
+
+	static std::string run_native(const program &prog, const std::string &input, std::string &output) // Returns why the executable couldn't be built or run, or ""
+	{
+		const char *tmp = getenv("TMPDIR");
+		std::string dir = std::string{tmp && *tmp ? tmp : "/tmp"} + "/pbrain-verify-XXXXXX";
+		if (! mkdtemp(&dir[0])) return "couldn't create " + dir;
+		std::string src = dir + "/deck.c", bin = dir + "/deck", in = dir + "/input", out = dir + "/output", ret{};
+		std::ofstream cfile{src}, infile{in, std::ios::binary};
+		native::emit(prog, cfile);
+		infile << input;
+		cfile.close();
+		infile.close();
+		std::vector<std::string> args = native::compiler();
+		args.insert(args.end(), {"-O2", "-o", bin, src});
+		if (cfile.fail() || infile.fail()) ret = "couldn't write " + dir;
+		else if (! native::spawn(args)) ret = "compilation failed";
+		else if (! native::spawn({bin, in}, out, native_limit)) ret = "abnormal exit";
+		else
+		{
+			std::ifstream outfile{out, std::ios::binary};
+			output.assign(std::istreambuf_iterator<char>{outfile}, std::istreambuf_iterator<char>{});
+		}
+		for (const std::string &f : {src, bin, in, out}) unlink(f.c_str());
+		rmdir(dir.c_str());
+		return ret;
+	}
+
+	static std::string compare(const std::string &deck, const std::string &input, bool &halts) // Describes the first disagreement with the stepper, or returns "" if all engines agree
+	{
+		outcome ref = run(deck, input, stepper);
+		halts = ref.error == "";
+		if (! halts) return "";
+		program prog{};
+		int engines = nengines;
+		try { prog.compile(deck); }
+		catch (std::runtime_error err) { engines = tiered + 1; } // Badly nested decks are meant to stay in the stepper
+		for (int e = stepper + 1; e < engines; e++)
+		{
+			outcome o = run(deck, input, e);
+			std::string field{};
+			if (o.error != "") field = "error (" + o.error + ")";
+			else if (o.output != ref.output) field = "output";
+			else if (o.base != ref.base || o.tape != ref.tape) field = "tape";
+			else if (o.ptr != ref.ptr) field = "pointer (" + util::t2s(o.ptr) + " vs " + util::t2s(ref.ptr) + ")";
+			else if (o.cnt != ref.cnt) field = "step count (" + util::t2s(o.cnt) + " vs " + util::t2s(ref.cnt) + ")";
+			else if (o.p != ref.p) field = "instruction pointer (" + util::t2s(o.p) + " vs " + util::t2s(ref.p) + ")";
+			else if (o.procs != ref.procs) field = "procedure table";
+			if (field != "") return std::string{name(e)} + " differs from " + name(stepper) + " in " + field;
+		}
+		if (engines == nengines && with_native()) // Only the output and exit status of an executable can be seen
+		{
+			std::string output{}, error = run_native(prog, input, output);
+			if (error != "") return "native differs from " + std::string{name(stepper)} + " in error (" + error + ")";
+			if (output != ref.output + "\n\n") return "native differs from " + std::string{name(stepper)} + " in output"; // Executables end with a blank line, like file runs
+		}
+		return "";
+	}
+
+	static bool nested(const std::string &deck)
+	{
+		std::string open{};
+		for (char c : deck)
+		{
+			if (c == '[' || c == '(') open += c;
+			else if (c == ']' || c == ')')
+			{
+				if (open.empty() || open.back() != (c == ']' ? '[' : '(')) return false;
+				open.pop_back();
+			}
+		}
+		return open.empty();
+	}
+
+	static std::string shrink(std::string deck, const std::string &input) // Delete ever smaller chunks as long as the deck still fails
+	{
+		for (std::size_t size = 0; size != deck.size(); )
+		{
+			size = deck.size();
+			for (std::size_t chunk = deck.size() / 2; chunk > 0; chunk /= 2)
+				for (std::size_t i = 0; i + chunk <= deck.size(); )
+				{
+					std::string cand = deck.substr(0, i) + deck.substr(i + chunk);
+					bool halts;
+					if (nested(cand) && compare(cand, input, halts) != "") deck = cand;
+					else i++;
+				}
+		}
+		return deck;
+	}
+
+	struct generator // Random decks that always halt: loops count their own cell down and never touch it otherwise
+	{
+		std::mt19937_64 rng;
+		std::vector<int> procs;
+
+		generator(uint64_t seed) : rng{seed}, procs{} { }
+
+		int pick(int n) { return std::uniform_int_distribution<int>{0, n - 1}(rng); }
+
+		std::string walk(int depth, bool top, bool calls) // Ends where it started; away from the top level, never moves left of the start
+		{
+			std::string ret{};
+			long pos = 0;
+			for (int n = pick(8) + 1; n > 0; n--)
+			{
+				int k = pick(14);
+				if (k < 3) ret += std::string(pick(5) + 1, "+-"[pick(2)]);
+				else if (k < 5)
+				{
+					int d = pick(4) + 1;
+					if (! top && pick(2) && pos >= d) { ret += std::string(d, '<'); pos -= d; }
+					else if (top && pick(2)) { ret += std::string(d, '<'); pos -= d; }
+					else { ret += std::string(d, '>'); pos += d; }
+				}
+				else if (k == 5) ret += ".,"[pick(2)];
+				else if (k == 6) ret += "?=%"[pick(3)];
+				else if (k == 7) ret += "[-]";
+				else if (k < 10 && depth < 3) ret += std::string(pick(2) ? "[-]" + std::string(pick(6) + 1, '+') : "") + "[>" + walk(depth + 1, false, calls) + "<-]";
+				else if (k == 10 && calls && ! procs.empty()) ret += "[-]" + std::string(procs[pick(procs.size())], '+') + ":";
+				else if (k == 11 && top)
+				{
+					int id = pick(8);
+					procs.push_back(id);
+					ret += "[-]" + std::string(id, '+') + "(" + walk(1, false, false) + ")";
+				}
+				else if (k == 12 && top && ! pick(8)) ret += "!";
+				else if (k == 13 && calls && ! procs.empty()) // Set up a row of procedure IDs, then call them one after another
+				{
+					int m = pick(3) + 2, d = pick(6) + 1;
+					for (int j = 0; j < m; j++) ret += "[-]" + std::string(procs[pick(procs.size())], '+') + std::string(d, '>');
+					ret += std::string(m * d, '<');
+					for (int j = 0; j < m; j++) ret += ":" + std::string(d, '>');
+					ret += std::string(m * d, '<');
+				}
+			}
+			ret += std::string(pos > 0 ? pos : 0, '<') + std::string(pos < 0 ? -pos : 0, '>');
+			return ret;
+		}
+
+		std::string deck()
+		{
+			procs.clear();
+			std::string ret{};
+			for (int n = pick(4) + 1; n > 0; n--) ret += walk(0, true, true);
+			return ret;
+		}
+
+		std::string input()
+		{
+			std::string ret{};
+			for (int n = pick(8); n > 0; n--) ret += (char) pick(256);
+			return ret;
+		}
+	};
+
+	void work()
+	{
+		for (unsigned long k; (k = next++) < cases && ! interrupted; )
+		{
+			generator g{k};
+			std::string deck = k < corpus.size() ? corpus[k] : g.deck(), input = g.input();
+			bool halts;
+			std::string diff = compare(deck, input, halts);
+			if (interrupted) break; // Engines stop early on ^C, so the last result means nothing
+			if (! halts) skipped++;
+			else if (diff != "")
+			{
+				std::string small = shrink(deck, input);
+				std::lock_guard<std::mutex> guard{lock};
+				failures++;
+				std::cout << "Case " << k << ": " << compare(small, input, halts) << "\n  Deck:  " << small << "\n  Input:";
+				for (char c : input) std::cout << " " << (int) (unsigned char) c;
+				std::cout << "\n" << std::flush;
+			}
+			if (++done % report_interval == 0)
+			{
+				std::lock_guard<std::mutex> guard{lock};
+				std::cerr << "Checked " << done << " cases, " << failures << " failures\n";
+			}
+		}
+	}
+
+	bool run() // Returns true if every engine agreed on every case
+	{
+		std::vector<std::thread> threads{};
+		for (unsigned int i = 0; i < std::max(1u, std::thread::hardware_concurrency()); i++) threads.push_back(std::thread{&verifier::work, this});
+		for (std::thread &t : threads) t.join();
+		std::cout << "Checked " << done << " cases (" << skipped << " didn't halt), " << failures << " failures\n";
+		return failures == 0;
 	}
 };
 
@@ -811,6 +3024,7 @@ struct runner
 	machine m;
 	curses::readline read;
 	bool exts, pbrain;
+	std::string pgo; // Profile for superinstruction synthesis, or empty
 	int rdln_x, rdln_y, rdln_w, rdln_h;
 	std::ostream &out = std::cout;
 
@@ -821,10 +3035,14 @@ struct runner
 	const static int redraw_procs = 0x10;
 	const static int redraw_all = 0x1f;
 
+	const static int slice = 5; // Milliseconds of execution between frames when not sleeping
+	const static std::size_t pgo_sequences = 16;
+
 	runner(std::istream &in) : m{in}, read{}
 	{
 		m.inbox.setsize(30, 69, 7, 40);
 		m.outbox.setsize(42, 69, 7, 40);
+		m.outbox.limit = 1 << 16;
 	}
 
 	std::string clean(const std::string &str)
@@ -903,15 +3121,31 @@ struct runner
 	int base_run()
 	{
 		int ret = 0;
+		interrupted = 0;
 		try
 		{
-			while (! m.step()) if (gui)
+			if (gui) while (true) // Run in time slices, drawing and servicing events between them
 			{
+				long slice_end = events::now() + slice;
+				bool done = false;
+				if (m.pf) m.pf->start();
+				do done = m.step();
+				while (! done && gui_sleep == 0 && events::now() < slice_end);
+				if (m.pf) m.pf->stop();
+				if (done) break;
+				m.t.rss = m.t.resident(); // Cells get dirtied between growths, so catch up once a frame
 				draw(runner::redraw_stats | runner::redraw_tape | runner::redraw_deck);
-				usleep(gui_sleep);
+				events::wait(gui_sleep / 1000);
+			}
+			else
+			{
+				if (m.pf) m.pf->start();
+				m.run();
+				if (m.pf) m.pf->stop();
 			}
 		}
 		catch (std::runtime_error e) { std::cerr << e.what(); ret = 1; }
+		if (interrupted && ! gui) std::cerr << "\nInterrupted; /c to continue";
 		std::cout << std::endl;
 		return ret;
 	}
@@ -923,6 +3157,85 @@ struct runner
 		return base_run();
 	}
 
+	int run_file(const std::string &path, const std::string &deck) // Run a deck from a file, going through the bytecode cache
+	{
+		uint32_t flags = (pbrain ? 1 : 0) | (exts ? 2 : 0);
+		uint64_t hash = util::hash(deck, util::t2s(flags));
+		std::string cached{};
+		try { cached = util::cachedir() + "/" + util::hash_hex(hash) + ".pbc"; }
+		catch (std::runtime_error e) { } // The cache is only an optimization, so run uncached without it
+		std::string cleaned{};
+		// A cached program may already be fused, so profile-guided runs always start from the deck
+		bool hit = m.deck == "" && pgo == "" && (m.prog.load(path + ".pbc", hash, flags, cleaned) || (cached != "" && m.prog.load(cached, hash, flags, cleaned)));
+		if (hit)
+		{
+			m.deck = cleaned;
+			m.compiled = true;
+		}
+		else m.load(clean(deck));
+		std::vector<std::string> seqs{};
+		unsigned long base_time = 0, base_dispatch = 0;
+		bool fused = false;
+		std::size_t nfused = 0;
+		bool profiled = pgo != "";
+		if (profiled && ! m.compiled)
+		{
+			try { m.prog.compile(m.deck); m.compiled = true; }
+			catch (std::runtime_error e) // Badly nested decks can only run in the stepper
+			{
+				m.compilable = false;
+				profiled = false;
+				std::cerr << "PGO: " << e.what() << ", running without a profile\n";
+			}
+		}
+		if (profiled)
+		{
+			fused = read_profile(hash, seqs, base_time, base_dispatch);
+			if (fused) nfused = m.prog.fuse(seqs);
+			m.counting = true;
+		}
+		if (gui) draw(runner::redraw_deck);
+		long start = events::now();
+		int ret = base_run();
+		if (profiled && ! interrupted) // A partial run would record a misleading profile
+		{
+			unsigned long elapsed = events::now() - start, dispatch = 0;
+			for (unsigned long c : m.opcounts) dispatch += c;
+			if (fused)
+			{
+				std::cerr << "PGO: " << nfused << " sequences fused into " << m.prog.supers.size() << " superinstructions\n";
+				std::cerr << "Dispatches: " << dispatch << " (unfused " << base_dispatch << ")\n";
+				std::cerr << "Time: " << elapsed << " ms (unfused " << base_time << " ms, speedup " << (elapsed ? (double) base_time / elapsed : 1.0) << "x)\n";
+			}
+			else write_profile(hash, m.prog.hot(m.opcounts, pgo_sequences), elapsed, dispatch);
+		}
+		if (m.compiled && (! hit || fused) && cached != "") m.prog.save(cached, hash, flags, m.deck); // Only decks that got hot enough to compile are cached
+		return ret;
+	}
+
+	bool read_profile(uint64_t hash, std::vector<std::string> &seqs, unsigned long &time, unsigned long &dispatch)
+	{
+		std::ifstream in{pgo};
+		std::string magic, word;
+		int ver;
+		uint64_t deckhash;
+		if (! (in >> magic >> ver >> std::hex >> deckhash >> std::dec) || magic != "pbrain-pgo" || ver != 1 || deckhash != hash) return false;
+		if (! (in >> word >> time >> word >> dispatch)) return false;
+		unsigned long weight;
+		std::string seq;
+		while (in >> weight >> seq) seqs.push_back(seq);
+		return true;
+	}
+
+	void write_profile(uint64_t hash, const std::vector<std::pair<unsigned long, std::string>> &hot, unsigned long time, unsigned long dispatch)
+	{
+		std::ofstream out{pgo};
+		if (out.fail()) throw std::runtime_error{"Couldn't write profile " + pgo};
+		out << "pbrain-pgo 1 " << util::hash_hex(hash) << "\n";
+		out << "time " << time << " dispatches " << dispatch << "\n";
+		for (const std::pair<unsigned long, std::string> &h : hot) out << h.first << " " << h.second << "\n";
+	}
+
 	int resume()
 	{
 		return base_run();
@@ -950,6 +3263,18 @@ struct runner
 			if (cmd[0] == "") return 0;
 			else if (cmd[0] == "q" || cmd[0] == "quit") return 1;
 			else if (cmd[0] == "r" || cmd[0] == "reset") m.reset();
+			else if (cmd[0] == "t" || cmd[0] == "trim") m.t.release();
+			else if (cmd[0] == "j" || cmd[0] == "jump")
+			{
+				if (cmd.size() > 1) m.t.jump(util::s2t<index_t>(cmd[1]));
+				else m.t.follow = true;
+				if (gui) draw(runner::redraw_tape);
+			}
+			else if (cmd[0] == "z" || cmd[0] == "zoom")
+			{
+				m.t.zoom = ! m.t.zoom;
+				if (gui) draw(runner::redraw_tape);
+			}
 			else if (cmd[0] == "c" || cmd[0] == "continue") resume();
 		}
 		else run(line);
@@ -959,11 +3284,16 @@ struct runner
 
 runner *r = 0;
 
-void resize(int num) // TODO Rate-limit calls to this
+void resize()
 {
 	if (r) r->draw(runner::redraw_all);
 }
 
+void interrupt(int num)
+{
+	interrupted = 1;
+}
+
 void sig(int num)
 {
 	if (r) delete r;
@@ -978,25 +3308,68 @@ void sig(int num)
 
 int main(int argc, char **argv) try
 {
-	bool exitflag = 1, pbflag = 1, extflag = 1;
+	bool exitflag = 1, pbflag = 1, extflag = 1, memoflag = 0;
+	std::string emitc{}, binout{}, tracefile{}, analyzefile{}, pgofile{};
+	bool spmdflag = 0, profflag = 0, perfflag = 0, hugeflag = 0;
+	std::size_t tapelimit = 0;
+	unsigned long verifycases = 0;
+	bool verifyflag = 0, parallelflag = 0;
+	const struct option longopts[] = {
+		{"spmd", no_argument, 0, 'S'},
+		{"profile", no_argument, 0, 'P'},
+		{"trace", required_argument, 0, 'T'},
+		{"analyze", required_argument, 0, 'A'},
+		{"pgo", required_argument, 0, 'G'},
+		{"perf", no_argument, 0, 'H'},
+		{"hugepages", no_argument, 0, 'U'},
+		{"tape-limit", required_argument, 0, 'L'},
+		{"verify", required_argument, 0, 'V'},
+		{"parallel", no_argument, 0, 'R'},
+		{"emit-c", required_argument, 0, 'C'},
+		{"compile", required_argument, 0, 'o'},
+		{0, 0, 0, 0}
+	};
 	int opt;
-	while ((opt = getopt(argc, argv, "degps:")) > 0)
+	while ((opt = getopt_long(argc, argv, "degmps:", longopts, 0)) > 0)
 	{
 		if (opt == 'g') gui = 1;
 		else if (opt == 'e') exitflag = 0;
 		else if (opt == 'd') extflag = 0;
 		else if (opt == 'p') pbflag = 0;
+		else if (opt == 'm') memoflag = 1;
 		else if (opt == 's') gui_sleep = 1000 * util::s2t<unsigned int>(std::string{optarg});
+		else if (opt == 'C') emitc = optarg;
+		else if (opt == 'o') binout = optarg;
+		else if (opt == 'S') spmdflag = 1;
+		else if (opt == 'P') profflag = 1;
+		else if (opt == 'T') tracefile = optarg;
+		else if (opt == 'A') analyzefile = optarg;
+		else if (opt == 'G') pgofile = optarg;
+		else if (opt == 'H') perfflag = 1;
+		else if (opt == 'U') hugeflag = 1;
+		else if (opt == 'V')
+		{
+			verifyflag = 1;
+			verifycases = util::s2t<unsigned long>(std::string{optarg});
+		}
+		else if (opt == 'R') parallelflag = 1;
+		else if (opt == 'L') tapelimit = util::s2t<std::size_t>(std::string{optarg}) << 20;
 		else return 1;
 	}
-	signal(2, sig);
+	if (gui && pgofile != "") throw std::runtime_error{"--pgo can't be used in UI mode"}; // The UI only steps, so nothing would be counted
+	if (analyzefile != "")
+	{
+		trace::analyze(analyzefile, std::cout);
+		return 0;
+	}
+	signal(2, interrupt);
 	signal(15, sig);
-	if (gui) signal(28, resize);
+	if (gui) events::init(resize);
 	curses::init();
-	if (gui) curses::scr_save();
 	bool deckflag = 0, inputflag = 0;
 	std::ifstream input{};
 	std::string deck;
+	std::vector<std::string> inputs{};
 	for (int arg = optind; arg < argc; arg++)
 	{
 		if (arg - optind == 0)
@@ -1007,6 +3380,7 @@ int main(int argc, char **argv) try
 			if (deckfile.fail()) throw std::runtime_error{std::string{"Couldn't open instruction deck "} + argv[arg]};
 			deck = std::string{std::istreambuf_iterator<char>{deckfile}, std::istreambuf_iterator<char>{}};
 		}
+		else if (spmdflag || verifyflag) inputs.push_back(argv[arg]);
 		else if (arg - optind == 1)
 		{
 			inputflag = 1;
@@ -1019,11 +3393,70 @@ int main(int argc, char **argv) try
 	else r = new runner{std::cin};
 	r->exts = extflag;
 	r->pbrain = pbflag;
+	r->m.memoize = memoflag;
+	r->m.profiling = profflag;
+	r->m.parallel = parallelflag;
+	r->pgo = pgofile;
+	if (perfflag) r->m.pf = new perf{};
+	r->m.t.huge = hugeflag;
+	r->m.t.limit = tapelimit;
+	if (tracefile != "") r->m.tr = r->m.pt.tr = new trace{tracefile};
+	if (spmdflag)
+	{
+		if (! deckflag || inputs.empty()) throw std::runtime_error{"SPMD mode requires an instruction deck and at least one input file"};
+		std::string cleaned = r->clean(deck);
+		program prog{};
+		prog.compile(cleaned);
+		spmd s{cleaned, prog, inputs};
+		bool done = s.run();
+		for (std::size_t l = 0; l < inputs.size(); l++) s.finish(l, ! done);
+		delete r;
+		return 0;
+	}
+	if (verifyflag) // Every file named on the command line is part of the corpus
+	{
+		std::vector<std::string> corpus{};
+		if (deckflag) corpus.push_back(r->clean(deck));
+		for (const std::string &path : inputs)
+		{
+			std::ifstream deckfile{path};
+			if (deckfile.fail()) throw std::runtime_error{"Couldn't open instruction deck " + path};
+			corpus.push_back(r->clean(std::string{std::istreambuf_iterator<char>{deckfile}, std::istreambuf_iterator<char>{}}));
+		}
+		verifier v{corpus, verifycases};
+		bool ok = v.run();
+		delete r;
+		return ok ? 0 : 1;
+	}
+	if (emitc != "" || binout != "")
+	{
+		if (! deckflag) throw std::runtime_error{"Native compilation requires an instruction deck"};
+		std::string cleaned = r->clean(deck);
+		program prog{};
+		prog.compile(cleaned);
+		if (emitc != "")
+		{
+			std::ofstream cfile{emitc};
+			if (cfile.fail()) throw std::runtime_error{"Couldn't open " + emitc};
+			native::emit(prog, cfile);
+		}
+		if (binout != "") native::build(prog, cleaned, binout);
+		delete r;
+		return 0;
+	}
+	if (gui) curses::scr_save();
 	if (gui) r->draw(runner::redraw_all);
-	if (deckflag) r->run(deck);
-	if (! deckflag || ! exitflag)  while(! r->prompt());
+	if (deckflag) r->run_file(argv[optind], deck);
+	if (! deckflag || ! exitflag || interrupted)  while(! r->prompt());
 	if (gui) curses::scr_restore();
 	else std::cout << "\n";
+	if (profflag) r->m.profile(std::cerr);
+	if (r->m.pf)
+	{
+		r->m.pf->report(std::cerr, r->m.cnt);
+		delete r->m.pf;
+	}
+	if (r->m.tr) delete r->m.tr;
 	if (r) delete(r);
 	return 0;
 }